@@ -6,6 +6,7 @@
  *   Copyright (C) 2014 Mario Kicherer (dev@kicherer.org)
  */
 
+#include <linux/delay.h>
 #include <linux/slab.h>
 #include <linux/usb.h>
 #include <sound/pcm.h>
@@ -16,15 +17,50 @@
 #include "audio.h"
 #include "bcd2000.h"
 
+static bool zero_copy;
+module_param(zero_copy, bool, 0444);
+MODULE_PARM_DESC(zero_copy, "Send playback data straight from the ALSA buffer if possible");
+
+static bool capture[SNDRV_CARDS];
+module_param_array(capture, bool, NULL, 0444);
+MODULE_PARM_DESC(capture, "Enable audio capture for the BCD2000 card.");
+
+static int playback_substreams = 1;
+module_param(playback_substreams, int, 0444);
+MODULE_PARM_DESC(playback_substreams, "Number of 4-channel playback substreams mixed by the driver (1-"
+		__stringify(BCD2000_MAX_MIX) ")");
+
+static bool decks[SNDRV_CARDS];
+module_param_array(decks, bool, NULL, 0444);
+MODULE_PARM_DESC(decks, "Add a stereo playback substream per deck on PCM device 1.");
+
+static bool inputs[SNDRV_CARDS];
+module_param_array(inputs, bool, NULL, 0444);
+MODULE_PARM_DESC(inputs, "Add a stereo capture substream per input on PCM device 1.");
+
+static int urbs = USB_N_URBS;
+module_param(urbs, int, 0644);
+MODULE_PARM_DESC(urbs, "Number of URBs in flight per stream (2-16)");
+
+static int packets_per_urb = USB_N_PACKETS_PER_URB;
+module_param(packets_per_urb, int, 0644);
+MODULE_PARM_DESC(packets_per_urb, "Number of 1 ms packets per URB (1-16)");
+
+static bool low_latency;
+module_param(low_latency, bool, 0644);
+MODULE_PARM_DESC(low_latency, "Use many short URBs, overrides urbs and packets_per_urb");
+
 static struct snd_pcm_hardware bcd2000_pcm_hardware = {
 	.info = SNDRV_PCM_INFO_MMAP |
 			SNDRV_PCM_INFO_INTERLEAVED |
+			SNDRV_PCM_INFO_PAUSE |
 			SNDRV_PCM_INFO_BATCH |
-			SNDRV_PCM_INFO_BLOCK_TRANSFER,
+			SNDRV_PCM_INFO_BLOCK_TRANSFER |
+			SNDRV_PCM_INFO_NO_PERIOD_WAKEUP,
 	.formats	= SNDRV_PCM_FMTBIT_S16_LE,
 	.rates		= SNDRV_PCM_RATE_44100,
-	.rate_min	= 44100,
-	.rate_max	= 44100,
+	.rate_min	= PCM_RATE,
+	.rate_max	= PCM_RATE,
 	.channels_min	= 4,
 	.channels_max	= 4,
 	.buffer_bytes_max = ALSA_BUFFER_SIZE,
@@ -36,440 +72,1748 @@ static struct snd_pcm_hardware bcd2000_pcm_hardware = {
 
 enum {
 	STREAM_DISABLED, /* no pcm streaming */
-	STREAM_STARTING, /* pcm streaming requested, waiting to become ready */
+	STREAM_STARTING, /* pcm streaming requested, URBs are being submitted */
 	STREAM_RUNNING, /* pcm streaming running */
 	STREAM_STOPPING
 };
 
-/* copy the audio frames from the URB packets into the ALSA buffer */
-static void bcd2000_pcm_capture(struct bcd2000_substream *sub, struct bcd2000_urb *urb)
-{
-	int i, frame, frame_count, bytes_per_frame;
-	void *src, *dest, *dest_end;
-	struct bcd2000_pcm *rt;
-	struct snd_pcm_runtime *alsa_rt;
+static int bcd2000_pcm_alloc_capture(struct bcd2000_pcm *pcm);
+static void bcd2000_pcm_release_capture(struct bcd2000_pcm *pcm);
 
-	rt = snd_pcm_substream_chip(sub->instance);
-	alsa_rt = sub->instance->runtime;
+/* return the driver stream of an ALSA substream */
+static struct bcd2000_substream *bcd2000_pcm_stream(struct bcd2000_pcm *pcm,
+					struct snd_pcm_substream *substream)
+{
+	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
+		return &pcm->playback;
+	else if (substream->stream == SNDRV_PCM_STREAM_CAPTURE)
+		return pcm->capture;
 
-	dest = (alsa_rt->dma_area + sub->dma_off);
-	dest_end = alsa_rt->dma_area +
-				frames_to_bytes(alsa_rt, alsa_rt->buffer_size);
+	return NULL;
+}
 
-	bytes_per_frame = alsa_rt->frame_bits / 8;
-	src = urb->buffer;
+/* return the client of an USB stream that serves an ALSA substream */
+static struct bcd2000_client *bcd2000_pcm_client(struct bcd2000_pcm *pcm,
+					struct bcd2000_substream *stream,
+					struct snd_pcm_substream *substream)
+{
+	/* the substreams of the second device serve the stereo pairs */
+	if (substream->pcm == pcm->instance)
+		return &stream->clients[substream->number];
 
-	for (i = 0; i < USB_N_PACKETS_PER_URB; i++) {
-		frame_count = urb->packets[i].actual_length / bytes_per_frame;
+	return &stream->clients[BCD2000_MAX_MIX + substream->number];
+}
 
-		for (frame = 0; frame < frame_count; frame++) {
-			memcpy(dest, src, bytes_per_frame);
+/*
+ * copy len bytes from buf into the ALSA ring buffer, at most two chunks are
+ * necessary: one up to the end of the ring buffer and one from its start
+ */
+static void bcd2000_pcm_copy_to_alsa(struct bcd2000_client *client,
+					struct snd_pcm_runtime *alsa_rt,
+					const u8 *buf, unsigned int len)
+{
+	unsigned int chunk, buffer_bytes;
 
-			dest += bytes_per_frame;
-			src += bytes_per_frame;
-			sub->dma_off += bytes_per_frame;
-			sub->period_off += bytes_per_frame;
+	buffer_bytes = frames_to_bytes(alsa_rt, alsa_rt->buffer_size);
 
-			if (dest >= dest_end) {
-				sub->dma_off = 0;
-				dest = alsa_rt->dma_area;
-			}
-		}
+	chunk = min(len, (unsigned int) (buffer_bytes - client->dma_off));
+	memcpy(alsa_rt->dma_area + client->dma_off, buf, chunk);
+	client->dma_off += chunk;
 
-		/* if packet was not full, make src point to data of next packet */
-		src += urb->packets[i].length - urb->packets[i].actual_length;
+	if (client->dma_off >= buffer_bytes) {
+		memcpy(alsa_rt->dma_area, buf + chunk, len - chunk);
+		client->dma_off = len - chunk;
 	}
+
+	client->period_off += len;
 }
 
-/* handle incoming URB with captured data */
-static void bcd2000_pcm_in_urb_handler(struct urb *usb_urb)
+/* counterpart of bcd2000_pcm_copy_to_alsa() for the playback direction */
+static void bcd2000_pcm_copy_from_alsa(struct bcd2000_client *client,
+					struct snd_pcm_runtime *alsa_rt,
+					u8 *buf, unsigned int len)
 {
-	struct bcd2000_urb *bcd2k_urb = usb_urb->context;
-	struct bcd2000_pcm *pcm = &bcd2k_urb->bcd2k->pcm;
-	struct bcd2000_substream *stream = bcd2k_urb->stream;
-	unsigned long flags;
-	int ret, k, period_bytes;
-	struct usb_iso_packet_descriptor *packet;
+	unsigned int chunk, buffer_bytes;
+
+	buffer_bytes = frames_to_bytes(alsa_rt, alsa_rt->buffer_size);
+
+	chunk = min(len, (unsigned int) (buffer_bytes - client->dma_off));
+	memcpy(buf, alsa_rt->dma_area + client->dma_off, chunk);
+	memcpy(buf + chunk, alsa_rt->dma_area, len - chunk);
+}
+
+/* levels measured during a single copy pass */
+struct bcd2000_meter {
+	u32 peak[USB_CHANNELS];
+	u64 squares[USB_CHANNELS];
+};
+
+/* account a sample of a channel in the meter of a copy pass */
+static inline void bcd2000_pcm_measure(struct bcd2000_meter *meter,
+					unsigned int c, s32 sample)
+{
+	meter->peak[c] = max_t(u32, meter->peak[c], abs(sample));
+	meter->squares[c] += sample * sample;
+}
+
+/* scale a sample by a gain factor and saturate it to 16 bits */
+static inline s32 bcd2000_pcm_scale(s32 sample, u32 gain)
+{
+	return clamp_t(s64, ((s64) sample * gain) >> GAIN_SHIFT, S16_MIN, S16_MAX);
+}
+
+/*
+ * add the levels measured by a copy pass to the meters, called with the
+ * stream lock held
+ *
+ * The meters move towards the levels of the pass with a weight that grows
+ * with its length, so they follow the signal with the same time constant
+ * whatever the URB size and however often they are read.
+ */
+static void bcd2000_pcm_add_meter(struct bcd2000_levels *levels,
+					const struct bcd2000_meter *meter,
+					unsigned int frames)
+{
+	u32 weight, mean;
+	int c;
 
-	if (pcm->panic || stream->state == STREAM_STOPPING)
+	if (!frames)
 		return;
 
-	if (unlikely(usb_urb->status == -ENOENT ||		/* unlinked */
-				usb_urb->status == -ENODEV ||		/* device removed */
-				usb_urb->status == -ECONNRESET ||	/* unlinked */
-				usb_urb->status == -ESHUTDOWN))		/* device disabled */
-	{
-		goto out_fail;
+	/* 16 fractional bits */
+	weight = min_t(u32, (frames << 16) / METER_DECAY_FRAMES, 1 << 16);
+
+	spin_lock(&levels->lock);
+	for (c = 0; c < USB_CHANNELS; c++) {
+		levels->peak[c] -= ((u64) levels->peak[c] * weight) >> 16;
+		levels->peak[c] = max(levels->peak[c], meter->peak[c]);
+
+		mean = div_u64(meter->squares[c], frames);
+		levels->mean_square[c] += ((s64) mean - levels->mean_square[c]) *
+						weight >> 16;
 	}
+	spin_unlock(&levels->lock);
+}
 
-	if (stream->state == STREAM_STARTING) {
-		stream->wait_cond = true;
-		wake_up(&stream->wait_queue);
+/*
+ * apply the capture gain to the frames of a packet in place and measure
+ * them, the packet is then still in the cache for the copies to the clients
+ */
+static void bcd2000_pcm_capture_levels(struct bcd2000_substream *sub,
+					struct bcd2000_meter *meter,
+					u8 *buf, unsigned int frames)
+{
+	__le16 *sample = (__le16 *) buf;
+	u32 gain[USB_CHANNELS];
+	unsigned int c, f;
+	s32 value;
+
+	for (c = 0; c < USB_CHANNELS; c++)
+		gain[c] = READ_ONCE(sub->levels->gain[c]);
+
+	for (f = 0; f < frames; f++) {
+		for (c = 0; c < USB_CHANNELS; c++, sample++) {
+			value = (s16) le16_to_cpu(*sample);
+			if (gain[c] != GAIN_UNITY) {
+				value = bcd2000_pcm_scale(value, gain[c]);
+				*sample = cpu_to_le16(value);
+			}
+			bcd2000_pcm_measure(meter, c, value);
+		}
 	}
+}
 
-	if (stream->active) {
-		spin_lock_irqsave(&stream->lock, flags);
+/* true if an application read the meters recently */
+static bool bcd2000_pcm_metering(struct bcd2000_levels *levels)
+{
+	return time_before(jiffies, READ_ONCE(levels->read_until));
+}
 
-		/* copy captured data into ALSA buffer */
-		bcd2000_pcm_capture(stream, bcd2k_urb);
+/* true if all channels of the stream pass unchanged */
+static bool bcd2000_pcm_unity_gain(struct bcd2000_substream *sub)
+{
+	int c;
 
-		period_bytes = snd_pcm_lib_period_bytes(stream->instance);
+	for (c = 0; c < USB_CHANNELS; c++)
+		if (READ_ONCE(sub->levels->gain[c]) != GAIN_UNITY)
+			return false;
 
-		/* do we have enough data for one period? */
-		if (stream->period_off > period_bytes) {
-			stream->period_off %= period_bytes;
+	return true;
+}
 
-			spin_unlock_irqrestore(&stream->lock, flags);
+/*
+ * deinterleave the frames of a packet into the buffers of the stereo clients
+ * in a single pass
+ */
+static void bcd2000_pcm_deinterleave(struct bcd2000_substream *sub,
+					unsigned long clients, const u8 *buf,
+					unsigned int frames)
+{
+	unsigned int i, c, f, chunk, buffer_bytes;
+	struct bcd2000_client *client;
+	struct snd_pcm_runtime *alsa_rt;
+	s16 *dst[BCD2000_MAX_CLIENTS];
+	const s16 *src = (const s16 *) buf;
+
+	while (frames) {
+		/* stop at the end of the first ring buffer that wraps */
+		chunk = frames;
+		for_each_set_bit(i, &clients, BCD2000_MAX_CLIENTS) {
+			client = &sub->clients[i];
+			alsa_rt = client->instance->runtime;
+			buffer_bytes = frames_to_bytes(alsa_rt, alsa_rt->buffer_size);
+
+			chunk = min(chunk, (unsigned int) bytes_to_frames(alsa_rt,
+						buffer_bytes - client->dma_off));
+			dst[i] = (s16 *) (alsa_rt->dma_area + client->dma_off);
+		}
+
+		for (f = 0; f < chunk; f++, src += USB_CHANNELS) {
+			for_each_set_bit(i, &clients, BCD2000_MAX_CLIENTS) {
+				client = &sub->clients[i];
+				for (c = 0; c < client->channels; c++)
+					*dst[i]++ = src[client->channel + c];
+			}
+		}
 
-			/* call this only once even if multiple periods are ready */
-			snd_pcm_period_elapsed(stream->instance);
+		for_each_set_bit(i, &clients, BCD2000_MAX_CLIENTS) {
+			client = &sub->clients[i];
+			alsa_rt = client->instance->runtime;
+			buffer_bytes = frames_to_bytes(alsa_rt, alsa_rt->buffer_size);
 
-			memset(bcd2k_urb->buffer, 0, USB_BUFFER_SIZE);
-		} else {
-			spin_unlock_irqrestore(&stream->lock, flags);
-			memset(bcd2k_urb->buffer, 0, USB_BUFFER_SIZE);
+			client->dma_off += frames_to_bytes(alsa_rt, chunk);
+			if (client->dma_off >= buffer_bytes)
+				client->dma_off = 0;
+			client->period_off += frames_to_bytes(alsa_rt, chunk);
 		}
-	} else {
-		memset(bcd2k_urb->buffer, 0, USB_BUFFER_SIZE);
+
+		frames -= chunk;
+	}
+}
+
+/*
+ * copy the audio frames from the URB packets into the ALSA buffers of the
+ * active clients, every packet is visited once while it is scaled, measured
+ * and distributed
+ */
+static void bcd2000_pcm_capture(struct bcd2000_substream *sub,
+					struct bcd2000_urb *urb, unsigned long clients)
+{
+	int i;
+	unsigned int k, len, frames = 0;
+	unsigned long pairs = 0;
+	struct bcd2000_client *client;
+	struct bcd2000_meter meter = {};
+	bool levels;
+	u8 *buf;
+
+	for_each_set_bit(k, &clients, BCD2000_MAX_CLIENTS)
+		if (sub->clients[k].channels != USB_CHANNELS)
+			pairs |= BIT(k);
+
+	/* the packets are only copied while no gain applies and nobody meters */
+	levels = !bcd2000_pcm_unity_gain(sub) || bcd2000_pcm_metering(sub->levels);
+
+	for (i = 0; i < sub->n_packets; i++) {
+		buf = urb->buffer + urb->packets[i].offset;
+
+		/* only copy complete frames, a packet might not be full */
+		len = urb->packets[i].actual_length;
+		len -= len % USB_BYTES_PER_FRAME;
+
+		/* replace a corrupted packet by silence to keep the timing */
+		if (urb->packets[i].status) {
+			len = PCM_RATE / USB_PACKETS_PER_SECOND * USB_BYTES_PER_FRAME;
+			memset(urb->buffer + urb->packets[i].offset, 0, len);
+		}
+
+		if (!len)
+			continue;
+
+		if (levels)
+			bcd2000_pcm_capture_levels(sub, &meter, buf,
+						len / USB_BYTES_PER_FRAME);
+		frames += len / USB_BYTES_PER_FRAME;
+
+		for_each_set_bit(k, &clients, BCD2000_MAX_CLIENTS) {
+			client = &sub->clients[k];
+			if (!(pairs & BIT(k)))
+				bcd2000_pcm_copy_to_alsa(client, client->instance->runtime,
+							buf, len);
+		}
+
+		if (pairs)
+			bcd2000_pcm_deinterleave(sub, pairs, buf,
+						len / USB_BYTES_PER_FRAME);
 	}
 
-	/* reset URB data */
-	for (k = 0; k < USB_N_PACKETS_PER_URB; k++) {
-		packet = &bcd2k_urb->packets[k];
-		packet->offset = k * USB_PACKET_SIZE;
-		packet->length = USB_PACKET_SIZE;
+	for_each_set_bit(k, &clients, BCD2000_MAX_CLIENTS)
+		sub->clients[k].link_frames += frames;
+
+	if (levels)
+		bcd2000_pcm_add_meter(sub->levels, &meter, frames);
+}
+
+/*
+ * reset the packet descriptors of an URB before it is (re)submitted
+ *
+ * 44.1 kHz does not divide into 1 ms packets, hence a playback packet
+ * carries either 44 or 45 frames as determined by a fractional accumulator.
+ * Capture packets are always large enough for 45 frames.
+ */
+static void bcd2000_pcm_init_packets(struct bcd2000_substream *sub, struct bcd2000_urb *urb)
+{
+	int k;
+	unsigned int offset, frames;
+	struct usb_iso_packet_descriptor *packet;
+
+	offset = 0;
+	urb->rate_acc = sub->rate_acc;
+
+	for (k = 0; k < sub->n_packets; k++) {
+		packet = &urb->packets[k];
+		packet->offset = offset;
+		if (sub->in) {
+			packet->length = USB_PACKET_SIZE;
+		} else {
+			sub->rate_acc += PCM_RATE;
+			frames = sub->rate_acc / USB_PACKETS_PER_SECOND;
+			sub->rate_acc -= frames * USB_PACKETS_PER_SECOND;
+
+			packet->length = frames * USB_BYTES_PER_FRAME;
+		}
 		packet->actual_length = 0;
 		packet->status = 0;
+
+		offset += packet->length;
 	}
-	bcd2k_urb->instance.number_of_packets = USB_N_PACKETS_PER_URB;
+	urb->instance.number_of_packets = sub->n_packets;
+	urb->instance.transfer_buffer_length = offset;
+}
 
-	/* send the URB back to the BCD2000 */
-	ret = usb_submit_urb(&bcd2k_urb->instance, GFP_ATOMIC);
-	if (ret < 0)
-		goto out_fail;
+/*
+ * return the bytes of the ALSA buffer of a client from the start of the
+ * oldest URB that still reads it directly up to the current position, called
+ * with the stream lock held
+ *
+ * URBs with copied frames may follow a direct URB, e.g., at the end of the
+ * ring buffer, hence everything behind the oldest direct URB is held back.
+ */
+static unsigned int bcd2000_pcm_direct_held(struct bcd2000_substream *sub,
+					struct bcd2000_client *client)
+{
+	unsigned long bit = BIT(client - sub->clients);
+	unsigned int i, held = 0, buffer_bytes;
+	struct bcd2000_urb *urb;
 
-	return;
+	buffer_bytes = snd_pcm_lib_buffer_bytes(client->instance);
 
-out_fail:
-	dev_info(&bcd2k_urb->bcd2k->dev->dev, PREFIX "error in in_urb handler");
-	pcm->panic = true;
+	for (i = 0; i < USB_MAX_URBS; i++) {
+		urb = &sub->urbs[i];
+		if (!urb->direct_len || !(urb->data_clients & bit))
+			continue;
+
+		/* the oldest URB is the farthest behind */
+		held = max(held, (client->dma_off + buffer_bytes - urb->direct_off) %
+				buffer_bytes);
+	}
+
+	return held;
 }
 
-/* copy audio frame from ALSA buffer into the URB packet */
-static void bcd2000_pcm_playback(struct bcd2000_substream *sub, struct bcd2000_urb *urb)
+/*
+ * estimate the drift of the sample clock against the host clock, called with
+ * the stream lock held before a returned capture URB is accounted
+ *
+ * A window spans about DRIFT_WINDOW consecutive USB frames. The frames the
+ * device captured in it are compared against the host time that passed
+ * between the completions at the borders of the window. The results are
+ * smoothed by an exponential filter.
+ *
+ * Only the capture stream follows the sample clock of the device, the length
+ * of the playback packets is chosen by the driver itself.
+ */
+static void bcd2000_pcm_estimate_drift(struct bcd2000_pcm *pcm,
+					struct bcd2000_substream *sub,
+					struct bcd2000_urb *urb, ktime_t now)
 {
-	int i, frame, frame_count, bytes_per_frame;
-	void *src, *src_end, *dest;
-	struct bcd2000_pcm *rt;
-	struct snd_pcm_runtime *alsa_rt;
+	int i;
+	s64 elapsed, expected, sample;
 
-	rt = snd_pcm_substream_chip(sub->instance);
-	alsa_rt = sub->instance->runtime;
+	/* gaps in the USB frame numbers or lost packets start a new window */
+	if (sub->last_frame < 0 || urb->instance.error_count ||
+		((urb->instance.start_frame - sub->last_frame) & USB_FRAME_MASK))
+		goto restart;
 
-	src = (alsa_rt->dma_area + sub->dma_off);
-	src_end = alsa_rt->dma_area +
-				frames_to_bytes(alsa_rt, alsa_rt->buffer_size);
+	for (i = 0; i < urb->instance.number_of_packets; i++)
+		sub->drift_frames += urb->packets[i].actual_length / USB_BYTES_PER_FRAME;
+	sub->drift_usb_frames += urb->instance.number_of_packets;
 
-	bytes_per_frame = alsa_rt->frame_bits / 8;
-	dest = urb->buffer;
+	if (sub->drift_usb_frames < DRIFT_WINDOW)
+		return;
 
-	for (i = 0; i < USB_N_PACKETS_PER_URB; i++) {
-		frame_count = urb->packets[i].length / bytes_per_frame;
+	elapsed = ktime_to_ns(ktime_sub(now, sub->drift_start));
+	expected = div_u64((u64) sub->drift_frames * NSEC_PER_SEC, PCM_RATE);
+	if (elapsed <= 0)
+		goto restart;
 
-		for (frame = 0; frame < frame_count; frame++) {
-			memcpy(dest, src, bytes_per_frame);
+	/* positive if the device transfers more frames than the host clock expects */
+	sample = div64_s64((expected - elapsed) * NSEC_PER_SEC, elapsed);
+	if (abs(sample) > DRIFT_MAX)
+		goto restart;
 
-			src += bytes_per_frame;
-			dest += bytes_per_frame;
-			sub->dma_off += bytes_per_frame;
-			sub->period_off += bytes_per_frame;
+	if (!sub->drift_windows++)
+		sub->drift = sample << DRIFT_FRAC;
+	else
+		sub->drift += ((sample << DRIFT_FRAC) - sub->drift) >> DRIFT_FILTER_SHIFT;
 
-			if (src >= src_end) {
-				sub->dma_off = 0;
-				src = alsa_rt->dma_area;
-			}
-		}
-	}
+	WRITE_ONCE(pcm->drift, (int) (sub->drift >> DRIFT_FRAC));
+	WRITE_ONCE(pcm->drift_valid, true);
+
+restart:
+	sub->drift_start = now;
+	sub->drift_usb_frames = 0;
+	sub->drift_frames = 0;
 }
 
-/* refill empty URB that comes back from the BCD2000 */
-static void bcd2000_pcm_out_urb_handler(struct urb *usb_urb)
+/* bookkeeping for a returned URB, called with the stream lock held */
+static void bcd2000_pcm_urb_done(struct bcd2000_substream *sub, struct bcd2000_urb *urb)
 {
-	struct bcd2000_urb *bcd2k_urb = usb_urb->context;
-	struct bcd2000_pcm *pcm = &bcd2k_urb->bcd2k->pcm;
-	struct bcd2000_substream *stream = bcd2k_urb->stream;
-	unsigned long flags;
-	int ret, k, period_bytes;
-	struct usb_iso_packet_descriptor *packet;
+	ktime_t now = ktime_get();
+	unsigned long clients = urb->data_clients;
+	unsigned int i;
 
+	if (sub->in)
+		bcd2000_pcm_estimate_drift(&urb->bcd2k->pcm, sub, urb, now);
 
-	if (pcm->panic || stream->state == STREAM_STOPPING)
-		return;
+	/* the frames sent by this URB can be overwritten by ALSA again */
+	urb->direct_len = 0;
 
-	if (unlikely(usb_urb->status == -ENOENT ||		/* unlinked */
-		usb_urb->status == -ENODEV ||		/* device removed */
-		usb_urb->status == -ECONNRESET ||	/* unlinked */
-		usb_urb->status == -ESHUTDOWN))		/* device disabled */
-	{
-		goto out_fail;
+	if (!sub->in) {
+		sub->queued -= urb->instance.transfer_buffer_length;
+
+		/* the frames of the clients mixed into the URB were played */
+		for_each_set_bit(i, &clients, BCD2000_MAX_CLIENTS)
+			sub->clients[i].link_frames += urb->data_frames;
 	}
 
-	if (stream->state == STREAM_STARTING) {
-		stream->wait_cond = true;
-		wake_up(&stream->wait_queue);
+	sub->last_frame = urb->instance.start_frame + urb->instance.number_of_packets;
+	sub->last_time = now;
+}
+
+/*
+ * publish the position of a client for the pointer callback, called with the
+ * stream lock held which serializes the writers
+ */
+static void bcd2000_pcm_publish_client(struct bcd2000_substream *sub,
+					struct bcd2000_client *client)
+{
+	unsigned int held, buffer_bytes = snd_pcm_lib_buffer_bytes(client->instance);
+
+	/* there is no position before hw_params */
+	if (!buffer_bytes)
+		return;
+
+	held = bcd2000_pcm_direct_held(sub, client);
+
+	write_seqcount_begin(&client->pos.seq);
+	client->pos.hw_off = (client->dma_off + buffer_bytes - held) % buffer_bytes;
+	client->pos.queued = (sub->queued - held) / USB_BYTES_PER_FRAME;
+	client->pos.last_frame = sub->last_frame;
+	client->pos.link_frames = client->link_frames;
+	client->pos.link_time = sub->last_time;
+	write_seqcount_end(&client->pos.seq);
+}
+
+/* publish the position of all attached clients */
+static void bcd2000_pcm_publish(struct bcd2000_substream *sub)
+{
+	int i;
+
+	for (i = 0; i < BCD2000_MAX_CLIENTS; i++)
+		if (sub->clients[i].instance)
+			bcd2000_pcm_publish_client(sub, &sub->clients[i]);
+}
+
+/*
+ * collect the active substreams that crossed a period boundary since the last
+ * call, called with the stream lock held
+ *
+ * snd_pcm_period_elapsed() updates the position from the pointer callback,
+ * hence a single call is enough even if an URB crossed several boundaries.
+ */
+static int bcd2000_pcm_count_periods(struct bcd2000_substream *sub,
+					struct snd_pcm_substream **elapsed)
+{
+	int i, n = 0;
+	unsigned int periods, period_bytes;
+	struct bcd2000_client *client;
+
+	for (i = 0; i < BCD2000_MAX_CLIENTS; i++) {
+		client = &sub->clients[i];
+		if (!client->active)
+			continue;
+
+		period_bytes = snd_pcm_lib_period_bytes(client->instance);
+
+		periods = client->period_off / period_bytes;
+		client->period_off %= period_bytes;
+
+		/* timer-scheduled clients rely on the pointer instead */
+		if (periods && !client->instance->runtime->no_period_wakeup)
+			elapsed[n++] = client->instance;
 	}
 
-	if (stream->active) {
-		spin_lock_irqsave(&stream->lock, flags);
+	return n;
+}
 
-		memset(bcd2k_urb->buffer, 0, USB_BUFFER_SIZE);
+/* collect the attached substreams of a set of clients */
+static int bcd2000_pcm_collect(struct bcd2000_substream *sub,
+					unsigned long clients,
+					struct snd_pcm_substream **instances)
+{
+	unsigned int i;
+	int n = 0;
 
-		/* fill URB with data from ALSA */
-		bcd2000_pcm_playback(stream, bcd2k_urb);
+	for_each_set_bit(i, &clients, BCD2000_MAX_CLIENTS)
+		if (sub->clients[i].instance)
+			instances[n++] = sub->clients[i].instance;
 
-		period_bytes = snd_pcm_lib_period_bytes(stream->instance);
+	return n;
+}
 
-		/* check if a complete period was written into the URB */
-		if (stream->period_off > period_bytes) {
-			stream->period_off %= period_bytes;
+/* fill the URB packets with silence while no client is active */
+static void bcd2000_pcm_silence(struct bcd2000_substream *sub, struct bcd2000_urb *urb)
+{
+	urb->instance.transfer_buffer = urb->buffer;
+	urb->instance.transfer_dma = urb->buffer_dma;
+	urb->direct_len = 0;
+	urb->lead_frames = 0;
+	urb->data_frames = 0;
+	urb->data_clients = 0;
 
-			spin_unlock_irqrestore(&stream->lock, flags);
+	memset(urb->buffer, 0, urb->instance.transfer_buffer_length);
+}
+
+/* move the read position of a playback client on by the frames taken */
+static void bcd2000_pcm_consume(struct bcd2000_client *client,
+				struct snd_pcm_runtime *alsa_rt,
+				snd_pcm_uframes_t frames)
+{
+	client->read_ptr += frames;
+	if (client->read_ptr >= alsa_rt->boundary)
+		client->read_ptr -= alsa_rt->boundary;
+}
+
+/*
+ * number of frames a playback client provided beyond the read position of the
+ * driver, 0 if the driver already read past the application pointer
+ *
+ * The read position counts the frames taken since prepare, like appl_ptr
+ * counts the written ones. The hardware pointer is not used, it only moves
+ * when ALSA updates it, which may not happen for a client without period
+ * wakeups whose application stalls.
+ */
+static snd_pcm_uframes_t bcd2000_pcm_playable(struct bcd2000_client *client)
+{
+	struct snd_pcm_runtime *alsa_rt = client->instance->runtime;
+	snd_pcm_uframes_t appl_ptr, avail;
+
+	appl_ptr = READ_ONCE(alsa_rt->control->appl_ptr);
+
+	if (appl_ptr >= client->read_ptr)
+		avail = appl_ptr - client->read_ptr;
+	else
+		avail = appl_ptr + alsa_rt->boundary - client->read_ptr;
+
+	return avail <= alsa_rt->buffer_size ? avail : 0;
+}
+
+/*
+ * handle the playback clients that did not provide enough frames, called with
+ * the stream lock held
+ *
+ * The missing frames were replaced by silence instead of the stale contents
+ * of the ring buffer. A client whose stop threshold lies within the buffer
+ * is stopped by the completion handler, one that runs freely only counts the
+ * underrun.
+ */
+static void bcd2000_pcm_underrun(struct bcd2000_substream *sub, unsigned long clients)
+{
+	struct snd_pcm_runtime *alsa_rt;
+	unsigned int i;
+
+	for_each_set_bit(i, &clients, BCD2000_MAX_CLIENTS) {
+		alsa_rt = sub->clients[i].instance->runtime;
 
-			snd_pcm_period_elapsed(stream->instance);
+		/* ALSA stops a draining stream itself once everything was played */
+		if (alsa_rt->status->state == SNDRV_PCM_STATE_DRAINING)
+			continue;
+
+		if (alsa_rt->stop_threshold <= alsa_rt->buffer_size) {
+			sub->xruns |= BIT(i);
 		} else {
-			spin_unlock_irqrestore(&stream->lock, flags);
+			sub->underruns++;
+			dev_dbg_ratelimited(&sub->urbs[0].bcd2k->dev->dev, PREFIX
+					"playback underrun, sending silence (%u underruns)\n",
+					sub->underruns);
 		}
+	}
+}
 
-		for (k = 0; k < USB_N_PACKETS_PER_URB; k++) {
-			packet = &bcd2k_urb->packets[k];
-			packet->offset = k * USB_PACKET_SIZE;
-			packet->length = USB_PACKET_SIZE;
-			packet->actual_length = 0;
-			packet->status = 0;
-		}
-		bcd2k_urb->instance.number_of_packets = USB_N_PACKETS_PER_URB;
+/*
+ * let the URB point straight into the ALSA buffer of a client that serves all
+ * channels, the CPU does not touch the frames
+ *
+ * Returns false if the frames have to be copied because zero copy is off or
+ * the payload straddles the end of the ring buffer.
+ */
+static bool bcd2000_pcm_send_direct(struct bcd2000_substream *sub,
+					struct bcd2000_client *client,
+					struct bcd2000_urb *urb, unsigned int total)
+{
+	unsigned int buffer_bytes;
+	struct bcd2000_pcm *rt;
+	struct snd_pcm_runtime *alsa_rt;
 
-		ret = usb_submit_urb(&bcd2k_urb->instance, GFP_ATOMIC);
-		if (ret < 0)
-			goto out_fail;
-	}
+	rt = snd_pcm_substream_chip(client->instance);
+	alsa_rt = client->instance->runtime;
+	buffer_bytes = frames_to_bytes(alsa_rt, alsa_rt->buffer_size);
+
+	/*
+	 * keep at least half of the ALSA buffer available to the application,
+	 * the frames sent directly cannot be released before the URB returns
+	 */
+	if (!rt->zero_copy || sub->users != 1 ||
+		client->dma_off + total > buffer_bytes ||
+		bcd2000_pcm_playable(client) < bytes_to_frames(alsa_rt, total) ||
+		bcd2000_pcm_direct_held(sub, client) + total > buffer_bytes / 2)
+		return false;
+
+	urb->instance.transfer_buffer = alsa_rt->dma_area + client->dma_off;
+	urb->instance.transfer_dma = alsa_rt->dma_addr + client->dma_off;
+	urb->direct_len = total;
+	urb->direct_off = client->dma_off;
+
+	client->dma_off += total;
+	if (client->dma_off >= buffer_bytes)
+		client->dma_off = 0;
+	client->period_off += total;
+	bcd2000_pcm_consume(client, alsa_rt, bytes_to_frames(alsa_rt, total));
+
+	return true;
+}
 
-	return;
+/*
+ * copy the frames of a client that serves all channels into the bounce buffer
+ * of the URB, the frames beyond its application pointer are silence
+ */
+static void bcd2000_pcm_send_copy(struct bcd2000_substream *sub,
+					struct bcd2000_client *client,
+					struct bcd2000_urb *urb)
+{
+	struct snd_pcm_runtime *alsa_rt = client->instance->runtime;
+	unsigned int len, total, buffer_bytes;
+	u8 *buf = urb->buffer + urb->lead_frames * USB_BYTES_PER_FRAME;
 
-out_fail:
-	dev_info(&bcd2k_urb->bcd2k->dev->dev, PREFIX "error in out_urb handler");
-	pcm->panic = true;
+	urb->instance.transfer_buffer = urb->buffer;
+	urb->instance.transfer_dma = urb->buffer_dma;
+	urb->direct_len = 0;
+
+	buffer_bytes = frames_to_bytes(alsa_rt, alsa_rt->buffer_size);
+	total = urb->data_frames * USB_BYTES_PER_FRAME;
+	len = min_t(snd_pcm_uframes_t, total,
+			frames_to_bytes(alsa_rt, bcd2000_pcm_playable(client)));
+
+	bcd2000_pcm_copy_from_alsa(client, alsa_rt, buf, len);
+	memset(buf + len, 0, total - len);
+
+	/* the position keeps moving with the device */
+	client->dma_off = (client->dma_off + total) % buffer_bytes;
+	client->period_off += total;
+	bcd2000_pcm_consume(client, alsa_rt, urb->data_frames);
+
+	if (len < total)
+		bcd2000_pcm_underrun(sub, BIT(client - sub->clients));
 }
 
-static void bcd2000_pcm_stream_stop(struct bcd2000_pcm *pcm, struct bcd2000_substream *stream)
+/*
+ * mix the frames of the active clients into the bounce buffer in a single
+ * pass, the samples of every channel are summed, scaled by the gain and
+ * saturated once, and measured for the meters
+ *
+ * The frames beyond the application pointer of a client are left out, i.e.,
+ * the client contributes silence, but its position keeps moving with the
+ * device.
+ *
+ * The kernel does not use vector registers in the completion handlers,
+ * hence the sum is computed per sample.
+ */
+static void bcd2000_pcm_mix(struct bcd2000_substream *sub,
+					struct bcd2000_urb *urb,
+					unsigned long clients, unsigned int frames)
 {
-	int i;
+	unsigned int i, c, f, chunk, remaining, buffer_bytes;
+	unsigned long fed, starved = 0;
+	struct bcd2000_client *client;
+	struct snd_pcm_runtime *alsa_rt;
+	snd_pcm_uframes_t playable[BCD2000_MAX_CLIENTS];
+	const __le16 *src[BCD2000_MAX_CLIENTS];
+	__le16 *dst = (__le16 *) urb->buffer + urb->lead_frames * USB_CHANNELS;
+	s32 acc[USB_CHANNELS], value;
+	u32 gain[USB_CHANNELS];
+	struct bcd2000_meter meter = {};
 
-	if (stream->state != STREAM_DISABLED) {
-		stream->state = STREAM_STOPPING;
+	urb->instance.transfer_buffer = urb->buffer;
+	urb->instance.transfer_dma = urb->buffer_dma;
+	urb->direct_len = 0;
+
+	for (c = 0; c < USB_CHANNELS; c++)
+		gain[c] = READ_ONCE(sub->levels->gain[c]);
+
+	for_each_set_bit(i, &clients, BCD2000_MAX_CLIENTS)
+		playable[i] = bcd2000_pcm_playable(&sub->clients[i]);
+
+	remaining = frames;
+	while (remaining) {
+		/*
+		 * stop at the end of the first ring buffer that wraps or at the
+		 * first application pointer that is reached
+		 */
+		chunk = remaining;
+		fed = 0;
+		for_each_set_bit(i, &clients, BCD2000_MAX_CLIENTS) {
+			client = &sub->clients[i];
+			alsa_rt = client->instance->runtime;
+			buffer_bytes = frames_to_bytes(alsa_rt, alsa_rt->buffer_size);
+
+			chunk = min(chunk, (unsigned int) bytes_to_frames(alsa_rt,
+						buffer_bytes - client->dma_off));
+			src[i] = (const __le16 *) (alsa_rt->dma_area + client->dma_off);
+
+			if (playable[i]) {
+				chunk = min_t(snd_pcm_uframes_t, chunk, playable[i]);
+				fed |= BIT(i);
+			} else {
+				starved |= BIT(i);
+			}
+		}
+
+		for (f = 0; f < chunk; f++, dst += USB_CHANNELS) {
+			memset(acc, 0, sizeof(acc));
 
-		for (i = 0; i < USB_N_URBS; i++) {
-			usb_kill_urb(&stream->urbs[i].instance);
+			for_each_set_bit(i, &fed, BCD2000_MAX_CLIENTS) {
+				client = &sub->clients[i];
+				for (c = 0; c < client->channels; c++)
+					acc[client->channel + c] += (s16) le16_to_cpu(*src[i]++);
+			}
+
+			for (c = 0; c < USB_CHANNELS; c++) {
+				value = bcd2000_pcm_scale(acc[c], gain[c]);
+				bcd2000_pcm_measure(&meter, c, value);
+				dst[c] = cpu_to_le16(value);
+			}
+		}
+
+		for_each_set_bit(i, &clients, BCD2000_MAX_CLIENTS) {
+			client = &sub->clients[i];
+			alsa_rt = client->instance->runtime;
+			buffer_bytes = frames_to_bytes(alsa_rt, alsa_rt->buffer_size);
+
+			client->dma_off += frames_to_bytes(alsa_rt, chunk);
+			if (client->dma_off >= buffer_bytes)
+				client->dma_off = 0;
+			client->period_off += frames_to_bytes(alsa_rt, chunk);
+			bcd2000_pcm_consume(client, alsa_rt, chunk);
+			if (fed & BIT(i))
+				playable[i] -= chunk;
 		}
 
-		stream->state = STREAM_DISABLED;
+		remaining -= chunk;
 	}
+
+	bcd2000_pcm_add_meter(sub->levels, &meter, frames);
+
+	if (starved)
+		bcd2000_pcm_underrun(sub, starved);
 }
 
-static int bcd2000_substream_open(struct snd_pcm_substream *substream)
+/* fill the URB packets with audio frames from the ALSA buffers */
+static void bcd2000_pcm_playback(struct bcd2000_substream *sub, struct bcd2000_urb *urb)
 {
-	struct bcd2000_substream *stream = NULL;
-	struct bcd2000_pcm *pcm = snd_pcm_substream_chip(substream);
+	int i;
+	unsigned int total;
+	unsigned long clients = 0;
+	struct bcd2000_client *client;
+
+	for (i = 0; i < BCD2000_MAX_CLIENTS; i++)
+		if (sub->clients[i].active)
+			clients |= BIT(i);
+
+	if (!clients) {
+		/* keep the URB circulating so that a restart takes effect immediately */
+		bcd2000_pcm_silence(sub, urb);
+		sub->lead_frames = 0;
+		return;
+	}
 
-	substream->runtime->hw = pcm->pcm_info;
+	/* the packets are contiguous, starting at offset 0 */
+	total = urb->instance.transfer_buffer_length;
+	urb->lead_frames = min(sub->lead_frames, total / USB_BYTES_PER_FRAME);
+	urb->data_frames = total / USB_BYTES_PER_FRAME - urb->lead_frames;
+	urb->data_clients = clients;
+	sub->lead_frames -= urb->lead_frames;
+
+	/* the prefill of the stream start did not reach the frames yet */
+	if (urb->lead_frames) {
+		urb->instance.transfer_buffer = urb->buffer;
+		urb->instance.transfer_dma = urb->buffer_dma;
+		urb->direct_len = 0;
+		memset(urb->buffer, 0, urb->lead_frames * USB_BYTES_PER_FRAME);
+		if (!urb->data_frames)
+			return;
+	}
 
-	if (pcm->panic)
-		return -EPIPE;
+	/*
+	 * the frames of a single client pass unchanged unless a gain applies or
+	 * the meters are read, which takes the mixing pass
+	 */
+	client = &sub->clients[__ffs(clients)];
+	if (hweight_long(clients) == 1 && client->channels == USB_CHANNELS &&
+		bcd2000_pcm_unity_gain(sub) && !bcd2000_pcm_metering(sub->levels)) {
+		if (urb->lead_frames || !bcd2000_pcm_send_direct(sub, client, urb, total))
+			bcd2000_pcm_send_copy(sub, client, urb);
+		return;
+	}
 
-	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
-		stream = &pcm->playback;
-	else if (substream->stream == SNDRV_PCM_STREAM_CAPTURE)
-		stream = &pcm->capture;
+	bcd2000_pcm_mix(sub, urb, clients, urb->data_frames);
+}
 
-	if (!stream) {
+/*
+ * undo the bookkeeping of an URB that could not be submitted for a set of
+ * clients, called with the stream lock held
+ *
+ * The frames it carried are sent with the next URB, hence no data is lost.
+ * The URB has to be the last one filled, the next one continues the 44/45
+ * frames pattern where it started.
+ */
+static void bcd2000_pcm_rewind(struct bcd2000_substream *sub,
+					struct bcd2000_urb *urb, unsigned long clients)
+{
+	struct bcd2000_client *client;
+	struct snd_pcm_runtime *alsa_rt;
+	unsigned int i, len, buffer_bytes;
+
+	clients &= urb->data_clients;
+	for_each_set_bit(i, &clients, BCD2000_MAX_CLIENTS) {
+		client = &sub->clients[i];
+		alsa_rt = client->instance->runtime;
+		buffer_bytes = frames_to_bytes(alsa_rt, alsa_rt->buffer_size);
+		len = frames_to_bytes(alsa_rt, urb->data_frames);
+
+		client->dma_off = (client->dma_off + buffer_bytes - len) % buffer_bytes;
+		client->period_off -= len;
+		if (client->read_ptr < urb->data_frames)
+			client->read_ptr += alsa_rt->boundary;
+		client->read_ptr -= urb->data_frames;
+	}
+
+	urb->direct_len = 0;
+	sub->queued -= urb->instance.transfer_buffer_length;
+	sub->rate_acc = urb->rate_acc;
+	sub->lead_frames += urb->lead_frames;
+
+	urb->lead_frames = 0;
+	urb->data_frames = 0;
+	urb->data_clients = 0;
+}
+
+/*
+ * drop a client from the bookkeeping of all URBs, called with the stream lock
+ * held
+ *
+ * URBs in flight may keep reading the old data, it is not held back anymore.
+ */
+static void bcd2000_pcm_forget(struct bcd2000_substream *sub,
+					struct bcd2000_client *client)
+{
+	unsigned long bit = BIT(client - sub->clients);
+	struct bcd2000_urb *urb;
+	int i;
+
+	for (i = 0; i < USB_MAX_URBS; i++) {
+		urb = &sub->urbs[i];
+		if (!(urb->data_clients & bit))
+			continue;
+
+		urb->direct_len = 0;
+		urb->data_clients &= ~bit;
+	}
+
+	sub->xruns &= ~bit;
+}
+
+/* return the URBs that send frames straight from the buffer of a client */
+static unsigned long bcd2000_pcm_direct_urbs(struct bcd2000_substream *sub,
+					struct bcd2000_client *client)
+{
+	unsigned long bit = BIT(client - sub->clients), urbs = 0;
+	int i;
+
+	for (i = 0; i < USB_MAX_URBS; i++)
+		if (sub->urbs[i].direct_len && (sub->urbs[i].data_clients & bit))
+			urbs |= BIT(i);
+
+	return urbs;
+}
+
+/*
+ * wait until no URB reads the ALSA buffer of a client anymore, called with the
+ * stream mutex held before the buffer is freed or the client is reset
+ *
+ * The client does not run, so its frames are not sent directly again. The
+ * URBs of a running stream return within the length of the queue. Those of a
+ * stream that stopped or that do not return in time are killed.
+ */
+static void bcd2000_pcm_wait_direct(struct bcd2000_pcm *pcm,
+					struct bcd2000_client *client)
+{
+	struct bcd2000_substream *stream = client->stream;
+	unsigned long flags, urbs;
+	unsigned int waited = 0;
+	bool running;
+	int i;
+
+	for (;;) {
+		spin_lock_irqsave(&stream->lock, flags);
+		urbs = bcd2000_pcm_direct_urbs(stream, client);
+		running = stream->state == STREAM_RUNNING && !pcm->panic;
+		spin_unlock_irqrestore(&stream->lock, flags);
+
+		if (!urbs)
+			return;
+		if (!running || waited >= USB_DIRECT_WAIT_MS)
+			break;
+
+		usleep_range(1000, 2000);
+		waited++;
+	}
+
+	if (running)
+		dev_warn(&pcm->bcd2k->dev->dev, PREFIX
+				"direct URBs did not return, killing them\n");
+
+	for_each_set_bit(i, &urbs, USB_MAX_URBS)
+		usb_kill_urb(&stream->urbs[i].instance);
+
+	spin_lock_irqsave(&stream->lock, flags);
+	for_each_set_bit(i, &urbs, USB_MAX_URBS)
+		stream->urbs[i].direct_len = 0;
+	spin_unlock_irqrestore(&stream->lock, flags);
+}
+
+/*
+ * prepare an URB for its next transfer and submit it, called with the stream
+ * lock held
+ */
+static int bcd2000_pcm_submit(struct bcd2000_substream *sub, struct bcd2000_urb *urb)
+{
+	int ret;
+
+	bcd2000_pcm_init_packets(sub, urb);
+
+	if (sub->in) {
+		memset(urb->buffer, 0, USB_BUFFER_SIZE);
+	} else {
+		/* fill URB with data from ALSA */
+		bcd2000_pcm_playback(sub, urb);
+		sub->queued += urb->instance.transfer_buffer_length;
+	}
+
+	ret = usb_submit_urb(&urb->instance, GFP_ATOMIC);
+	if (ret < 0 && !sub->in)
+		bcd2000_pcm_rewind(sub, urb, urb->data_clients);
+
+	return ret;
+}
+
+/* stop the ALSA stream because frames were lost */
+static void bcd2000_pcm_xrun(struct snd_pcm_substream *substream)
+{
+	#if LINUX_VERSION_CODE < KERNEL_VERSION(4,1,0)
+	unsigned long flags;
+
+	snd_pcm_stream_lock_irqsave(substream, flags);
+	if (snd_pcm_running(substream))
+		snd_pcm_stop(substream, SNDRV_PCM_STATE_XRUN);
+	snd_pcm_stream_unlock_irqrestore(substream, flags);
+	#else
+	snd_pcm_stop_xrun(substream);
+	#endif
+}
+
+/* count an error the stream recovers from, called with the stream lock held */
+static void bcd2000_pcm_recovered(struct bcd2000_substream *sub,
+					struct bcd2000_urb *urb, int err)
+{
+	sub->recoveries++;
+
+	dev_warn_ratelimited(&urb->bcd2k->dev->dev, PREFIX
+			"%s stream recovering from error %d (%u recoveries)\n",
+			sub->in ? "capture" : "playback", err, sub->recoveries);
+}
+
+/*
+ * hand an URB that could not be submitted over to the recovery work, called
+ * with the stream lock held
+ */
+static void bcd2000_pcm_defer_urb(struct bcd2000_substream *sub,
+					struct bcd2000_urb *urb, int err)
+{
+	bcd2000_pcm_recovered(sub, urb, err);
+
+	sub->last_error = err;
+	sub->idle_urbs |= BIT(urb - sub->urbs);
+	schedule_delayed_work(&sub->recovery_work,
+				msecs_to_jiffies(USB_RECOVERY_DELAY_MS));
+}
+
+/*
+ * resubmit the URBs that failed to be submitted from the completion handlers
+ *
+ * If submitting keeps failing, the stream is stopped with an xrun and
+ * restarted by the next prepare.
+ */
+static void bcd2000_pcm_recovery_work(struct work_struct *work)
+{
+	struct bcd2000_substream *stream = container_of(to_delayed_work(work),
+					struct bcd2000_substream, recovery_work);
+	unsigned long flags;
+	int i, n = 0, ret = 0;
+	struct snd_pcm_substream *instances[BCD2000_MAX_CLIENTS];
+
+	spin_lock_irqsave(&stream->lock, flags);
+
+	if (stream->state != STREAM_RUNNING) {
+		spin_unlock_irqrestore(&stream->lock, flags);
+		return;
+	}
+
+	/* submit in the original order, the frames are assigned in this order */
+	for (i = 0; i < stream->n_urbs; i++) {
+		if (!(stream->idle_urbs & BIT(i)))
+			continue;
+
+		ret = bcd2000_pcm_submit(stream, &stream->urbs[i]);
+		if (ret < 0) {
+			stream->last_error = ret;
+			break;
+		}
+
+		stream->idle_urbs &= ~BIT(i);
+	}
+	bcd2000_pcm_publish(stream);
+
+	if (!stream->idle_urbs) {
+		stream->retries = 0;
+		stream->last_error = 0;
+	} else if (++stream->retries < USB_RECOVERY_RETRIES) {
+		schedule_delayed_work(&stream->recovery_work,
+					msecs_to_jiffies(USB_RECOVERY_DELAY_MS));
+	} else {
+		/* let the URBs drain, the next prepare restarts the stream */
+		stream->state = STREAM_STOPPING;
+		n = bcd2000_pcm_collect(stream, BIT(BCD2000_MAX_CLIENTS) - 1, instances);
+		dev_err(&stream->urbs[0].bcd2k->dev->dev, PREFIX
+				"usb_submit_urb failed: %d\n", ret);
+	}
+
+	spin_unlock_irqrestore(&stream->lock, flags);
+
+	for (i = 0; i < n; i++)
+		bcd2000_pcm_xrun(instances[i]);
+}
+
+/*
+ * check the status of a returned URB
+ *
+ * Returns 1 if the URB has to be handled and resubmitted, 0 if it was
+ * unlinked and -ENODEV if the device is gone.
+ */
+static int bcd2000_pcm_check_urb(struct bcd2000_substream *sub,
+					struct bcd2000_urb *urb)
+{
+	unsigned long flags;
+	int i, status = urb->instance.status;
+
+	switch (status) {
+	case 0:
+		break;
+	case -ENOENT:		/* unlinked */
+	case -ECONNRESET:	/* unlinked */
+		return 0;
+	case -ENODEV:		/* device removed */
+	case -ESHUTDOWN:	/* device disabled */
+		return -ENODEV;
+	default:
+		/* e.g. -EXDEV or -EPROTO, the packet status tells which data is affected */
+		spin_lock_irqsave(&sub->lock, flags);
+		bcd2000_pcm_recovered(sub, urb, status);
+		spin_unlock_irqrestore(&sub->lock, flags);
+		return 1;
+	}
+
+	if (urb->instance.error_count) {
+		/* report the first packet that failed */
+		for (i = 0; i < urb->instance.number_of_packets; i++) {
+			status = urb->packets[i].status;
+			if (status)
+				break;
+		}
+		spin_lock_irqsave(&sub->lock, flags);
+		bcd2000_pcm_recovered(sub, urb, status);
+		spin_unlock_irqrestore(&sub->lock, flags);
+	}
+
+	return 1;
+}
+
+/* handle incoming URB with captured data */
+static void bcd2000_pcm_in_urb_handler(struct urb *usb_urb)
+{
+	struct bcd2000_urb *bcd2k_urb = usb_urb->context;
+	struct bcd2000_pcm *pcm = &bcd2k_urb->bcd2k->pcm;
+	struct bcd2000_substream *stream = bcd2k_urb->stream;
+	struct snd_pcm_substream *elapsed[BCD2000_MAX_CLIENTS];
+	unsigned long flags, clients;
+	int i, ret, n;
+
+	if (pcm->panic)
+		return;
+
+	ret = bcd2000_pcm_check_urb(stream, bcd2k_urb);
+	if (ret < 0)
+		goto out_fail;
+	if (ret == 0)
+		return;
+
+	spin_lock_irqsave(&stream->lock, flags);
+
+	/* a stopping stream lets its URBs drain */
+	if (stream->state != STREAM_RUNNING) {
+		spin_unlock_irqrestore(&stream->lock, flags);
+		return;
+	}
+
+	bcd2000_pcm_urb_done(stream, bcd2k_urb);
+
+	/* copy captured data into the ALSA buffers */
+	clients = 0;
+	for (i = 0; i < BCD2000_MAX_CLIENTS; i++)
+		if (stream->clients[i].active)
+			clients |= BIT(i);
+	if (clients)
+		bcd2000_pcm_capture(stream, bcd2k_urb, clients);
+	n = bcd2000_pcm_count_periods(stream, elapsed);
+
+	/* send the URB back to the BCD2000 */
+	ret = bcd2000_pcm_submit(stream, bcd2k_urb);
+	if (ret < 0)
+		bcd2000_pcm_defer_urb(stream, bcd2k_urb, ret);
+	bcd2000_pcm_publish(stream);
+
+	spin_unlock_irqrestore(&stream->lock, flags);
+
+	/* one call accounts for all periods that are ready */
+	for (i = 0; i < n; i++)
+		snd_pcm_period_elapsed(elapsed[i]);
+
+	return;
+
+out_fail:
+	dev_info(&bcd2k_urb->bcd2k->dev->dev, PREFIX "error in in_urb handler");
+	pcm->panic = true;
+}
+
+/* refill empty URB that comes back from the BCD2000 */
+static void bcd2000_pcm_out_urb_handler(struct urb *usb_urb)
+{
+	struct bcd2000_urb *bcd2k_urb = usb_urb->context;
+	struct bcd2000_pcm *pcm = &bcd2k_urb->bcd2k->pcm;
+	struct bcd2000_substream *stream = bcd2k_urb->stream;
+	struct snd_pcm_substream *elapsed[BCD2000_MAX_CLIENTS];
+	struct snd_pcm_substream *stopped[BCD2000_MAX_CLIENTS];
+	unsigned long flags;
+	int i, ret, n, n_stopped;
+
+	if (pcm->panic)
+		return;
+
+	ret = bcd2000_pcm_check_urb(stream, bcd2k_urb);
+	if (ret < 0)
+		goto out_fail;
+	if (ret == 0)
+		return;
+
+	spin_lock_irqsave(&stream->lock, flags);
+
+	/* a stopping stream lets its URBs drain */
+	if (stream->state != STREAM_RUNNING) {
+		spin_unlock_irqrestore(&stream->lock, flags);
+		return;
+	}
+
+	bcd2000_pcm_urb_done(stream, bcd2k_urb);
+
+	ret = bcd2000_pcm_submit(stream, bcd2k_urb);
+	if (ret < 0)
+		bcd2000_pcm_defer_urb(stream, bcd2k_urb, ret);
+
+	n = bcd2000_pcm_count_periods(stream, elapsed);
+	bcd2000_pcm_publish(stream);
+
+	/* stop the clients that ran out of frames */
+	n_stopped = bcd2000_pcm_collect(stream, stream->xruns, stopped);
+	stream->xruns = 0;
+
+	spin_unlock_irqrestore(&stream->lock, flags);
+
+	for (i = 0; i < n_stopped; i++)
+		bcd2000_pcm_xrun(stopped[i]);
+	for (i = 0; i < n; i++)
+		snd_pcm_period_elapsed(elapsed[i]);
+
+	return;
+
+out_fail:
+	dev_info(&bcd2k_urb->bcd2k->dev->dev, PREFIX "error in out_urb handler");
+	pcm->panic = true;
+}
+
+/*
+ * stop the URBs of a stream, called with the stream mutex held
+ *
+ * Once the state is not running anymore, neither the handlers nor the
+ * recovery work submit URBs. The work is cancelled before the URBs are
+ * killed, so it cannot resubmit one of them afterwards.
+ */
+static void bcd2000_pcm_stream_stop(struct bcd2000_pcm *pcm, struct bcd2000_substream *stream)
+{
+	unsigned long flags;
+	int i;
+
+	if (stream->state == STREAM_DISABLED)
+		return;
+
+	spin_lock_irqsave(&stream->lock, flags);
+	stream->state = STREAM_STOPPING;
+	spin_unlock_irqrestore(&stream->lock, flags);
+
+	cancel_delayed_work_sync(&stream->recovery_work);
+
+	for (i = 0; i < USB_MAX_URBS; i++)
+		usb_kill_urb(&stream->urbs[i].instance);
+
+	spin_lock_irqsave(&stream->lock, flags);
+	stream->idle_urbs = 0;
+	stream->retries = 0;
+	stream->last_error = 0;
+	stream->drift_windows = 0;
+	stream->state = STREAM_DISABLED;
+	spin_unlock_irqrestore(&stream->lock, flags);
+
+	/* the estimate is not updated anymore */
+	if (stream->in)
+		WRITE_ONCE(pcm->drift_valid, false);
+}
+
+/*
+ * choose the URB geometry from the module parameters, the geometry is kept
+ * until the last substream of the stream is closed
+ */
+static void bcd2000_pcm_set_geometry(struct bcd2000_substream *stream)
+{
+	if (READ_ONCE(low_latency)) {
+		stream->n_urbs = USB_LOW_LATENCY_N_URBS;
+		stream->n_packets = USB_LOW_LATENCY_PACKETS_PER_URB;
+	} else {
+		stream->n_urbs = clamp_t(int, READ_ONCE(urbs), 2, USB_MAX_URBS);
+		stream->n_packets = clamp_t(int, READ_ONCE(packets_per_urb), 1,
+						USB_MAX_PACKETS_PER_URB);
+	}
+}
+
+/* adapt the hardware limits to the geometry and the channels of a client */
+static void bcd2000_pcm_set_limits(struct bcd2000_substream *stream,
+					struct bcd2000_client *client,
+					struct snd_pcm_hardware *hw)
+{
+	hw->channels_min = client->channels;
+	hw->channels_max = client->channels;
+
+	/*
+	 * a period spans at least one URB, but never has to be longer than the
+	 * 441 frames it always allowed, an URB may then complete more than one
+	 */
+	hw->period_bytes_min = min(BYTES_PER_PERIOD,
+				stream->n_packets * USB_PACKET_SIZE) /
+				USB_CHANNELS * client->channels;
+	hw->periods_max = hw->buffer_bytes_max / hw->period_bytes_min;
+}
+
+/*
+ * attach a client to its stream, called with the stream mutex held
+ *
+ * The playback clients are mixed and captured channels can be read by any
+ * number of clients, hence the clients do not exclude each other.
+ */
+static void bcd2000_pcm_attach(struct bcd2000_substream *stream,
+					struct bcd2000_client *client,
+					struct snd_pcm_substream *substream)
+{
+	unsigned long flags;
+
+	if (!stream->users)
+		bcd2000_pcm_set_geometry(stream);
+
+	spin_lock_irqsave(&stream->lock, flags);
+	client->instance = substream;
+	client->active = false;
+	client->dma_off = 0;
+	client->period_off = 0;
+	client->read_ptr = 0;
+	stream->users++;
+	spin_unlock_irqrestore(&stream->lock, flags);
+}
+
+/* detach a client from its stream, the last one stops the URBs */
+static void bcd2000_pcm_detach(struct bcd2000_pcm *pcm, struct bcd2000_client *client)
+{
+	struct bcd2000_substream *stream = client->stream;
+	unsigned long flags;
+
+	mutex_lock(&stream->mutex);
+	if (stream->users == 1)
+		bcd2000_pcm_stream_stop(pcm, stream);
+
+	spin_lock_irqsave(&stream->lock, flags);
+	bcd2000_pcm_forget(stream, client);
+	client->instance = NULL;
+	client->active = false;
+	stream->users--;
+	spin_unlock_irqrestore(&stream->lock, flags);
+	mutex_unlock(&stream->mutex);
+}
+
+static int bcd2000_substream_open(struct snd_pcm_substream *substream)
+{
+	int ret;
+	struct bcd2000_substream *stream = NULL;
+	struct bcd2000_client *client;
+	struct bcd2000_pcm *pcm = snd_pcm_substream_chip(substream);
+
+	substream->runtime->hw = pcm->pcm_info;
+
+	if (pcm->panic)
+		return -EPIPE;
+
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE) {
+		ret = bcd2000_pcm_alloc_capture(pcm);
+		if (ret < 0)
+			return ret;
+	}
+
+	stream = bcd2000_pcm_stream(pcm, substream);
+
+	if (!stream) {
 		dev_err(&pcm->bcd2k->dev->dev, PREFIX "invalid stream type\n");
 		return -EINVAL;
 	}
 
-	mutex_lock(&stream->mutex);
-	stream->instance = substream;
-	stream->active = false;
-	mutex_unlock(&stream->mutex);
+	client = bcd2000_pcm_client(pcm, stream, substream);
+
+	mutex_lock(&stream->mutex);
+	bcd2000_pcm_attach(stream, client, substream);
+	bcd2000_pcm_set_limits(stream, client, &substream->runtime->hw);
+	mutex_unlock(&stream->mutex);
+
+	substream->runtime->private_data = client;
+
+	ret = snd_pcm_hw_constraint_integer(substream->runtime,
+					SNDRV_PCM_HW_PARAM_PERIODS);
+	if (ret < 0)
+		goto err;
+
+	/* an URB takes its frames from the buffer at once, keep room for two */
+	ret = snd_pcm_hw_constraint_minmax(substream->runtime,
+					SNDRV_PCM_HW_PARAM_BUFFER_SIZE,
+					2 * stream->n_packets * USB_PACKET_SIZE /
+					USB_BYTES_PER_FRAME, UINT_MAX);
+	if (ret < 0)
+		goto err;
+
+	/*
+	 * With 10 or more packets per URB, i.e., the default geometry, the
+	 * period size is a multiple of 441 frames. Together with the silence
+	 * that stream_start puts in front of the first frame, every period of
+	 * the substream that starts the stream ends on a packet boundary.
+	 * Shorter URBs, e.g., with low_latency, allow any period size, its
+	 * wakeup then comes with the URB that crosses the boundary, which is at
+	 * most a few milliseconds late.
+	 */
+	if (stream->n_packets >= USB_PACKETS_PER_CYCLE) {
+		ret = snd_pcm_hw_constraint_step(substream->runtime, 0,
+					SNDRV_PCM_HW_PARAM_PERIOD_SIZE, FRAMES_PER_CYCLE);
+		if (ret < 0)
+			goto err;
+	}
+
+	return 0;
+
+err:
+	bcd2000_pcm_detach(pcm, client);
+	if (stream->in)
+		bcd2000_pcm_release_capture(pcm);
+	return ret;
+}
+
+static int bcd2000_substream_close(struct snd_pcm_substream *substream)
+{
+	struct bcd2000_pcm *pcm = snd_pcm_substream_chip(substream);
+	struct bcd2000_client *client = substream->runtime->private_data;
+
+	bcd2000_pcm_detach(pcm, client);
+
+	if (client->stream->in)
+		bcd2000_pcm_release_capture(pcm);
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
+static int bcd2000_pcm_hw_params(struct snd_pcm_substream *substream,
+				struct snd_pcm_hw_params *hw_params)
+{
+	#if LINUX_VERSION_CODE < KERNEL_VERSION(5,5,0)
+	return snd_pcm_lib_alloc_vmalloc_buffer(substream,
+					params_buffer_bytes(hw_params));
+	#else
+	return snd_pcm_lib_malloc_pages(substream,
+					params_buffer_bytes(hw_params));
+	#endif
+}
+#endif
+
+/*
+ * release the ALSA buffer, no URB may read it anymore once it is freed or
+ * allocated anew
+ */
+static int bcd2000_pcm_hw_free(struct snd_pcm_substream *substream)
+{
+	struct bcd2000_pcm *pcm = snd_pcm_substream_chip(substream);
+	struct bcd2000_client *client = substream->runtime->private_data;
+
+	mutex_lock(&client->stream->mutex);
+	bcd2000_pcm_wait_direct(pcm, client);
+	mutex_unlock(&client->stream->mutex);
+
+	#if LINUX_VERSION_CODE < KERNEL_VERSION(5,5,0)
+	return snd_pcm_lib_free_vmalloc_buffer(substream);
+	#elif LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
+	return snd_pcm_lib_free_pages(substream);
+	#else
+	/* the buffer is managed by ALSA */
+	return 0;
+	#endif
+}
+
+/*
+ * submit all URBs of a stream, called from the trigger callback
+ *
+ * Playback URBs are prefilled with the frames the application wrote until
+ * the start threshold was reached. If these do not fill all URBs, silence
+ * goes out first, so the frames are played without a gap and the clients do
+ * not underrun. URB_ISO_ASAP schedules the URBs for the next USB frame.
+ * Afterwards, the URBs keep circulating until the substream is closed. URBs
+ * that cannot be submitted are retried by the recovery work.
+ */
+static int bcd2000_pcm_stream_start(struct bcd2000_pcm *pcm, struct bcd2000_substream *stream)
+{
+	unsigned long flags;
+	unsigned int prefill, written;
+	int i, ret;
+	struct bcd2000_urb *urb;
+
+	spin_lock_irqsave(&stream->lock, flags);
+
+	if (stream->state != STREAM_DISABLED) {
+		spin_unlock_irqrestore(&stream->lock, flags);
+		return 0;
+	}
+
+	/* the alternate setting is being changed by a prepare */
+	if (stream->held) {
+		spin_unlock_irqrestore(&stream->lock, flags);
+		return -EBUSY;
+	}
+
+	/* reset panic state when starting a new stream */
+	pcm->panic = false;
+
+	stream->state = STREAM_STARTING;
+	stream->idle_urbs = 0;
+	stream->retries = 0;
+	stream->last_error = 0;
+	stream->queued = 0;
+	stream->last_frame = -1;
+	stream->rate_acc = 0;
+	stream->lead_frames = 0;
+
+	/*
+	 * the prefill must not run past the frames the applications have
+	 * written, the rest of it is silence in front of their frames. The
+	 * packet sizes repeat every 441 frames from the start of the stream,
+	 * so with the period step of substream_open the silence is rounded up
+	 * to whole cycles to let the periods end on packet boundaries.
+	 */
+	if (!stream->in) {
+		prefill = stream->n_urbs * stream->n_packets * PCM_RATE /
+				USB_PACKETS_PER_SECOND;
+		written = prefill;
+		for (i = 0; i < BCD2000_MAX_CLIENTS; i++)
+			if (stream->clients[i].active)
+				written = min_t(snd_pcm_uframes_t, written,
+					bcd2000_pcm_playable(&stream->clients[i]));
+		stream->lead_frames = prefill - written;
+		if (stream->n_packets >= USB_PACKETS_PER_CYCLE)
+			stream->lead_frames = roundup(stream->lead_frames,
+						FRAMES_PER_CYCLE);
+	}
+
+	for (i = 0; i < stream->n_urbs; i++) {
+		urb = &stream->urbs[i];
+		urb->direct_len = 0;
+		urb->lead_frames = 0;
+		urb->data_frames = 0;
+		urb->data_clients = 0;
+		urb->instance.transfer_buffer = urb->buffer;
+		urb->instance.transfer_dma = urb->buffer_dma;
+
+		ret = bcd2000_pcm_submit(stream, urb);
+		if (ret < 0)
+			bcd2000_pcm_defer_urb(stream, urb, ret);
+	}
+
+	stream->state = STREAM_RUNNING;
+	bcd2000_pcm_publish(stream);
+
+	spin_unlock_irqrestore(&stream->lock, flags);
 
 	return 0;
 }
 
-static int bcd2000_substream_close(struct snd_pcm_substream *substream)
+/* return the packet size of an isochronous endpoint in an alternate setting, 0 if absent */
+static unsigned int bcd2000_pcm_alt_maxp(struct usb_host_interface *alt, u8 ep)
 {
-	unsigned long flags;
-	struct bcd2000_pcm *pcm = snd_pcm_substream_chip(substream);
-	struct bcd2000_substream *stream = NULL;
-
-	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
-		stream = &pcm->playback;
-	else if (substream->stream == SNDRV_PCM_STREAM_CAPTURE)
-		stream = &pcm->capture;
-
-	if (pcm->panic)
-		return 0;
+	struct usb_endpoint_descriptor *epd;
+	unsigned int k;
 
-	mutex_lock(&stream->mutex);
-	if (stream) {
-		bcd2000_pcm_stream_stop(pcm, stream);
-
-		spin_lock_irqsave(&stream->lock, flags);
-		stream->instance = NULL;
-		stream->active = false;
-		spin_unlock_irqrestore(&stream->lock, flags);
+	for (k = 0; k < alt->desc.bNumEndpoints; k++) {
+		epd = &alt->endpoint[k].desc;
+		if (epd->bEndpointAddress == ep && usb_endpoint_xfer_isoc(epd))
+			return usb_endpoint_maxp(epd);
 	}
-	mutex_unlock(&stream->mutex);
 
 	return 0;
 }
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
-static int bcd2000_pcm_hw_params(struct snd_pcm_substream *substream,
-				struct snd_pcm_hw_params *hw_params)
+/* true if an alternate setting keeps both MIDI endpoints */
+static bool bcd2000_pcm_alt_has_midi(struct usb_host_interface *alt)
 {
-	#if LINUX_VERSION_CODE < KERNEL_VERSION(5,5,0)
-	return snd_pcm_lib_alloc_vmalloc_buffer(substream,
-					params_buffer_bytes(hw_params));
-	#else
-	return snd_pcm_lib_malloc_pages(substream,
-					params_buffer_bytes(hw_params));
-	#endif
+	struct usb_endpoint_descriptor *epd;
+	unsigned int k, found = 0;
+
+	for (k = 0; k < alt->desc.bNumEndpoints; k++) {
+		epd = &alt->endpoint[k].desc;
+		if (!usb_endpoint_xfer_int(epd))
+			continue;
+		if (epd->bEndpointAddress == MIDI_EP_IN)
+			found |= 1;
+		else if (epd->bEndpointAddress == MIDI_EP_OUT)
+			found |= 2;
+	}
+
+	return found == 3;
 }
 
-static int bcd2000_pcm_hw_free(struct snd_pcm_substream *substream)
+/*
+ * hold or release the start of both streams, called with the PCM mutex held
+ *
+ * Returns false if a stream already runs.
+ */
+static bool bcd2000_pcm_hold_streams(struct bcd2000_pcm *pcm, bool hold)
 {
-	#if LINUX_VERSION_CODE < KERNEL_VERSION(5,5,0)
-	return snd_pcm_lib_free_vmalloc_buffer(substream);
-	#else
-	return snd_pcm_lib_free_pages(substream);
-	#endif
+	struct bcd2000_substream *streams[2] = { &pcm->playback, pcm->capture };
+	unsigned long flags;
+	bool idle = true;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(streams); i++) {
+		if (!streams[i])
+			continue;
+
+		spin_lock_irqsave(&streams[i]->lock, flags);
+		if (streams[i]->state != STREAM_DISABLED)
+			idle = false;
+		streams[i]->held = hold;
+		spin_unlock_irqrestore(&streams[i]->lock, flags);
+	}
+
+	return idle;
 }
-#endif
 
-static int bcd2000_pcm_stream_start(struct bcd2000_pcm *pcm, struct bcd2000_substream *stream)
+/*
+ * select the alternate setting with the smallest isochronous bandwidth
+ * reservation that still carries the largest packets of the streams
+ *
+ * While a capture substream is open, the setting has to carry both endpoints,
+ * so that the second stream can start while the first one is running.
+ * Otherwise, no bandwidth is reserved for capture. The MIDI endpoints
+ * have to be kept in any case. Switching resets all endpoints of the
+ * interface, hence it is only done while no stream runs, and the streams are
+ * held back from starting meanwhile. The MIDI input is restarted afterwards.
+ *
+ * Called with the PCM mutex held, which keeps the capture stream allocated.
+ */
+static void bcd2000_pcm_negotiate(struct bcd2000_pcm *pcm)
 {
+	struct usb_interface *intf = pcm->bcd2k->intf;
+	struct usb_host_interface *alt, *best = NULL;
+	unsigned int i, out_maxp, in_maxp, best_maxp = 0;
 	int ret;
-	int i, k;
-	struct usb_iso_packet_descriptor *packet;
-
-	if (stream->state == STREAM_DISABLED) {
-		/* reset panic state when starting a new stream */
-		pcm->panic = false;
-
-		stream->state = STREAM_STARTING;
-
-		/* initialize data of each URB */
-		for (i = 0; i < USB_N_URBS; i++) {
-			for (k = 0; k < USB_N_PACKETS_PER_URB; k++) {
-				packet = &stream->urbs[i].packets[k];
-				packet->offset = k * USB_PACKET_SIZE;
-				packet->length = USB_PACKET_SIZE;
-				packet->actual_length = 0;
-				packet->status = 0;
-			}
 
-			/* immediately send data with the first audio out URB */
-			if (stream->instance == SNDRV_PCM_STREAM_PLAYBACK) {
-				bcd2000_pcm_playback(stream, &stream->urbs[i]);
-			}
+	if (!intf)
+		return;
 
-			ret = usb_submit_urb(&stream->urbs[i].instance, GFP_ATOMIC);
-			if (ret) {
-				dev_err(&pcm->bcd2k->dev->dev, PREFIX
-						"usb_submit_urb failed: %d\n", ret);
-				bcd2000_pcm_stream_stop(pcm, stream);
-				return ret;
-			}
+	for (i = 0; i < intf->num_altsetting; i++) {
+		alt = &intf->altsetting[i];
+
+		out_maxp = bcd2000_pcm_alt_maxp(alt, USB_EP_AUDIO_OUT);
+		in_maxp = bcd2000_pcm_alt_maxp(alt, USB_EP_AUDIO_IN);
+		if (out_maxp < USB_PACKET_SIZE)
+			continue;
+		if (pcm->capture && in_maxp < USB_PACKET_SIZE)
+			continue;
+		if (!bcd2000_pcm_alt_has_midi(alt))
+			continue;
+
+		if (!best || out_maxp + in_maxp < best_maxp) {
+			best = alt;
+			best_maxp = out_maxp + in_maxp;
 		}
+	}
 
-		/* wait for first out urb to return (sent in in urb handler) */
-		wait_event_timeout(stream->wait_queue,
-						   stream->wait_cond, HZ);
-		if (stream->wait_cond) {
-			dev_dbg(&pcm->bcd2k->dev->dev, PREFIX
-					"%s: stream is running wakeup event\n", __func__);
-			stream->state = STREAM_RUNNING;
-		} else {
-			bcd2000_pcm_stream_stop(pcm, stream);
-			return -EIO;
-		}
+	if (!best || best == intf->cur_altsetting)
+		return;
+
+	if (!bcd2000_pcm_hold_streams(pcm, true))
+		goto out;
+
+	ret = usb_set_interface(pcm->bcd2k->dev, best->desc.bInterfaceNumber,
+				best->desc.bAlternateSetting);
+	if (ret < 0) {
+		dev_warn(&pcm->bcd2k->dev->dev, PREFIX
+				"could not select alternate setting %d: %d\n",
+				best->desc.bAlternateSetting, ret);
+		goto out;
 	}
-	return 0;
+
+	dev_dbg(&pcm->bcd2k->dev->dev, PREFIX
+			"alternate setting %d, %u bytes per frame reserved\n",
+			best->desc.bAlternateSetting, best_maxp);
+
+	bcd2000_midi_resume_input(pcm->bcd2k);
+
+out:
+	bcd2000_pcm_hold_streams(pcm, false);
 }
 
 static int bcd2000_pcm_prepare(struct snd_pcm_substream *substream)
 {
 	struct bcd2000_pcm *pcm = snd_pcm_substream_chip(substream);
-	int ret;
-	struct bcd2000_substream *stream = NULL;
-
-	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
-		stream = &pcm->playback;
-	else if (substream->stream == SNDRV_PCM_STREAM_CAPTURE)
-		stream = &pcm->capture;
+	struct bcd2000_client *client = substream->runtime->private_data;
+	struct bcd2000_substream *stream = client->stream;
+	unsigned long flags;
+	int ret = 0;
 
 	if (pcm->panic)
 		return -EPIPE;
 
-	if (!stream)
-		return -ENODEV;
-
+	/* the PCM mutex comes first, like on disconnect */
+	mutex_lock(&pcm->mutex);
 	mutex_lock(&stream->mutex);
-	stream->dma_off = 0;
-	stream->period_off = 0;
+
+	/* collect the URBs of a stream that failed to recover */
+	if (stream->state == STREAM_STOPPING)
+		bcd2000_pcm_stream_stop(pcm, stream);
 
 	if (stream->state == STREAM_DISABLED) {
-		ret = bcd2000_pcm_stream_start(pcm, stream);
-		if (ret) {
-			mutex_unlock(&stream->mutex);
-			dev_err(&pcm->bcd2k->dev->dev, PREFIX
-					"could not start pcm stream\n");
-			return ret;
+		bcd2000_pcm_negotiate(pcm);
+
+		/*
+		 * capture opened while playback runs without reserving its
+		 * bandwidth, it has to wait until playback is closed
+		 */
+		if (pcm->bcd2k->intf && bcd2000_pcm_alt_maxp(pcm->bcd2k->intf->cur_altsetting,
+				stream->in ? USB_EP_AUDIO_IN : USB_EP_AUDIO_OUT) <
+				USB_PACKET_SIZE) {
+			ret = -EBUSY;
+			goto out;
 		}
 	}
+
+	/* the URBs of the last run must not be forgotten while they are in flight */
+	bcd2000_pcm_wait_direct(pcm, client);
+
+	spin_lock_irqsave(&stream->lock, flags);
+	client->dma_off = 0;
+	client->period_off = 0;
+	client->read_ptr = 0;
+	client->link_frames = 0;
+	bcd2000_pcm_forget(stream, client);
+	bcd2000_pcm_publish_client(stream, client);
+	spin_unlock_irqrestore(&stream->lock, flags);
+
+out:
 	mutex_unlock(&stream->mutex);
-	return 0;
+	mutex_unlock(&pcm->mutex);
+	return ret;
 }
 
 static int bcd2000_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 {
 	struct bcd2000_pcm *pcm = snd_pcm_substream_chip(substream);
-	struct bcd2000_substream *stream = NULL;
+	struct bcd2000_client *client = substream->runtime->private_data;
+	struct bcd2000_substream *stream = client->stream;
 	unsigned long flags;
 
-	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
-		stream = &pcm->playback;
-	else if (substream->stream == SNDRV_PCM_STREAM_CAPTURE)
-		stream = &pcm->capture;
-
 	if (pcm->panic)
 		return -EPIPE;
 
-	if (!stream)
-		return -ENODEV;
-
 	switch (cmd) {
 		case SNDRV_PCM_TRIGGER_START:
 		case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
 			spin_lock_irqsave(&stream->lock, flags);
-			stream->active = true;
+			client->active = true;
 			spin_unlock_irqrestore(&stream->lock, flags);
 
-			return 0;
+			/* only the first start submits the URBs */
+			return bcd2000_pcm_stream_start(pcm, stream);
 
 		case SNDRV_PCM_TRIGGER_STOP:
 		case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
 			spin_lock_irqsave(&stream->lock, flags);
-			stream->active = false;
+			client->active = false;
 			spin_unlock_irqrestore(&stream->lock, flags);
 
 			return 0;
@@ -478,41 +1822,215 @@ static int bcd2000_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 	}
 }
 
+/*
+ * estimate the number of frames the device transferred since the last URB
+ * returned, based on the USB frame counter
+ */
+static unsigned int bcd2000_pcm_elapsed_frames(struct bcd2000_pcm *pcm,
+					struct bcd2000_substream *stream, int last_frame)
+{
+	int frame;
+	unsigned int frames;
+
+	if (last_frame < 0)
+		return 0;
+
+	frame = usb_get_current_frame_number(pcm->bcd2k->dev);
+	if (frame < 0)
+		return 0;
+
+	frames = ((frame - last_frame) & USB_FRAME_MASK) * PCM_RATE /
+			USB_PACKETS_PER_SECOND;
+
+	/* the next URB returns after at most one URB worth of frames */
+	return min(frames, (unsigned int) DIV_ROUND_UP(stream->n_packets * PCM_RATE,
+							USB_PACKETS_PER_SECOND));
+}
+
 static snd_pcm_uframes_t
 bcd2000_pcm_pointer(struct snd_pcm_substream *substream)
 {
 	struct bcd2000_pcm *pcm = snd_pcm_substream_chip(substream);
-	unsigned long flags;
+	struct snd_pcm_runtime *alsa_rt = substream->runtime;
 	snd_pcm_uframes_t ret;
-	struct bcd2000_substream *stream = NULL;
-
-	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
-		stream = &pcm->playback;
-	else if (substream->stream == SNDRV_PCM_STREAM_CAPTURE)
-		stream = &pcm->capture;
+	snd_pcm_sframes_t delay;
+	struct bcd2000_client *client = alsa_rt->private_data;
+	struct bcd2000_substream *stream = client->stream;
+	unsigned int seq, hw_off, queued, elapsed;
+	int last_frame;
 
-	if (pcm->panic || !stream)
+	if (pcm->panic)
 		return SNDRV_PCM_POS_XRUN;
 
-	spin_lock_irqsave(&stream->lock, flags);
-	/* return the number of the last written period in the ALSA ring buffer */
-	ret = bytes_to_frames(stream->instance->runtime, stream->dma_off);
-	spin_unlock_irqrestore(&stream->lock, flags);
+	/*
+	 * return the number of the last written period in the ALSA ring buffer,
+	 * the handlers publish it without the frames that URBs still read
+	 * directly and never wait for us
+	 */
+	do {
+		seq = read_seqcount_begin(&client->pos.seq);
+		hw_off = client->pos.hw_off;
+		queued = client->pos.queued;
+		last_frame = client->pos.last_frame;
+	} while (read_seqcount_retry(&client->pos.seq, seq));
+
+	ret = bytes_to_frames(alsa_rt, hw_off);
+
+	/*
+	 * The pointer only moves when an URB returns. Report the frames
+	 * between the pointer and the device through the delay instead:
+	 * the frames that are still queued for playback or the frames that
+	 * were captured into the URB in flight.
+	 */
+	elapsed = bcd2000_pcm_elapsed_frames(pcm, stream, last_frame);
+	if (stream->in)
+		delay = elapsed;
+	else
+		delay = max_t(snd_pcm_sframes_t,
+				(snd_pcm_sframes_t) queued - elapsed, 0);
+	alsa_rt->delay = delay;
 
 	return ret;
 }
 
+/*
+ * estimate the number of frames of a client that passed the USB link by now
+ *
+ * The frames are interpolated from the host time since the last URB returned,
+ * corrected by the drift of the sample clock. The USB frame counter confines
+ * the result to the USB frame the device is transferring, as the completion
+ * of the URB may have been delayed.
+ */
+static u64 bcd2000_pcm_link_frames(struct bcd2000_pcm *pcm,
+					struct bcd2000_client *client, ktime_t now)
+{
+	struct bcd2000_substream *stream = client->stream;
+	unsigned int seq, usb_frames, frames, min_frames, max_frames;
+	u64 link_frames;
+	ktime_t link_time;
+	s64 elapsed;
+	int frame, last_frame;
+
+	do {
+		seq = read_seqcount_begin(&client->pos.seq);
+		last_frame = client->pos.last_frame;
+		link_frames = client->pos.link_frames;
+		link_time = client->pos.link_time;
+	} while (read_seqcount_retry(&client->pos.seq, seq));
+
+	if (last_frame < 0 || !READ_ONCE(client->active))
+		return link_frames;
+
+	frame = usb_get_current_frame_number(pcm->bcd2k->dev);
+	if (frame < 0)
+		return link_frames;
+
+	usb_frames = (frame - last_frame) & USB_FRAME_MASK;
+	min_frames = usb_frames * PCM_RATE / USB_PACKETS_PER_SECOND;
+	max_frames = (usb_frames + 1) * PCM_RATE / USB_PACKETS_PER_SECOND;
+
+	/* the bounds below apply long before a second passed */
+	elapsed = clamp_t(s64, ktime_to_ns(ktime_sub(now, link_time)), 0, NSEC_PER_SEC);
+	/* both directions run on the sample clock the capture stream measures */
+	if (READ_ONCE(pcm->drift_valid))
+		elapsed += div_s64(elapsed * READ_ONCE(pcm->drift), NSEC_PER_SEC);
+	frames = clamp_t(u64, div_u64(elapsed * PCM_RATE, NSEC_PER_SEC),
+				min_frames, max_frames);
+
+	/* the next URB returns after at most one URB worth of frames */
+	frames = min(frames, (unsigned int) DIV_ROUND_UP(stream->n_packets * PCM_RATE,
+							USB_PACKETS_PER_SECOND));
+
+	return link_frames + frames;
+}
+
+/*
+ * get the number of frames of the running playback clients that passed the
+ * USB link by now, used to tag MIDI events, returns the running clients
+ */
+unsigned long bcd2000_pcm_playback_positions(struct bcd2000 *bcd2k, u64 *frames)
+{
+	struct bcd2000_pcm *pcm = &bcd2k->pcm;
+	ktime_t now = ktime_get();
+	unsigned long active = 0;
+	int i;
+
+	/* MIDI input starts before the audio part is set up */
+	if (!READ_ONCE(pcm->instance))
+		return 0;
+
+	for (i = 0; i < BCD2000_MAX_CLIENTS; i++) {
+		frames[i] = 0;
+		if (!READ_ONCE(pcm->playback.clients[i].active))
+			continue;
+
+		frames[i] = bcd2000_pcm_link_frames(pcm, &pcm->playback.clients[i], now);
+		active |= BIT(i);
+	}
+
+	return active;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0)
+/*
+ * report the position of the frames on the USB link, i.e., the frames the
+ * device is playing or capturing right now, together with the system time
+ */
+static int bcd2000_pcm_get_time_info(struct snd_pcm_substream *substream,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+					struct timespec64 *system_ts, struct timespec64 *audio_ts,
+#else
+					struct timespec *system_ts, struct timespec *audio_ts,
+#endif
+					struct snd_pcm_audio_tstamp_config *audio_tstamp_config,
+					struct snd_pcm_audio_tstamp_report *audio_tstamp_report)
+{
+	struct bcd2000_pcm *pcm = snd_pcm_substream_chip(substream);
+	struct bcd2000_client *client = substream->runtime->private_data;
+	u64 frames;
+	ktime_t now;
+
+	if (audio_tstamp_config->type_requested !=
+			SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK_ESTIMATED) {
+		audio_tstamp_report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_DEFAULT;
+		return 0;
+	}
+
+	/* both clocks are read back to back */
+	snd_pcm_gettime(substream->runtime, system_ts);
+	now = ktime_get();
+
+	frames = bcd2000_pcm_link_frames(pcm, client, now);
+	#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+	*audio_ts = ns_to_timespec64(div_u64(frames * NSEC_PER_SEC, PCM_RATE));
+	#else
+	*audio_ts = ns_to_timespec(div_u64(frames * NSEC_PER_SEC, PCM_RATE));
+	#endif
+
+	audio_tstamp_report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK_ESTIMATED;
+	audio_tstamp_report->valid = 1;
+	/* the USB frame counter bounds the error to one USB frame */
+	audio_tstamp_report->accuracy_report = 1;
+	audio_tstamp_report->accuracy = NSEC_PER_SEC / USB_PACKETS_PER_SECOND;
+
+	return 0;
+}
+#endif
+
 static const struct snd_pcm_ops bcd2000_ops = {
 	.open = bcd2000_substream_open,
 	.close = bcd2000_substream_close,
 	.ioctl = snd_pcm_lib_ioctl,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,6,0)
 	.hw_params = bcd2000_pcm_hw_params,
-	.hw_free = bcd2000_pcm_hw_free,
 #endif
+	.hw_free = bcd2000_pcm_hw_free,
 	.prepare = bcd2000_pcm_prepare,
 	.trigger = bcd2000_pcm_trigger,
 	.pointer = bcd2000_pcm_pointer,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0)
+	.get_time_info = bcd2000_pcm_get_time_info,
+#endif
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5,5,0)
 	.page = snd_pcm_lib_get_vmalloc_page,
 #endif
@@ -526,9 +2044,21 @@ static int bcd2000_pcm_init_urb(struct bcd2000_urb *urb,
 	urb->bcd2k = bcd2k;
 	usb_init_urb(&urb->instance);
 
-	urb->buffer = kcalloc(USB_PACKET_SIZE, USB_N_PACKETS_PER_URB, GFP_KERNEL);
-	if (!urb->buffer)
-		return -ENOMEM;
+	if (bcd2k->pcm.zero_copy) {
+		/* avoid mapping the bounce buffer for every transfer */
+		urb->buffer = usb_alloc_coherent(bcd2k->dev, USB_BUFFER_SIZE,
+						GFP_KERNEL, &urb->buffer_dma);
+		if (!urb->buffer)
+			return -ENOMEM;
+		memset(urb->buffer, 0, USB_BUFFER_SIZE);
+
+		urb->instance.transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		urb->instance.transfer_dma = urb->buffer_dma;
+	} else {
+		urb->buffer = kcalloc(USB_PACKET_SIZE, USB_MAX_PACKETS_PER_URB, GFP_KERNEL);
+		if (!urb->buffer)
+			return -ENOMEM;
+	}
 
 	urb->instance.transfer_buffer = urb->buffer;
 	urb->instance.transfer_buffer_length = USB_BUFFER_SIZE;
@@ -536,23 +2066,39 @@ static int bcd2000_pcm_init_urb(struct bcd2000_urb *urb,
 	urb->instance.pipe = in ? usb_rcvisocpipe(bcd2k->dev, ep)
 							: usb_sndisocpipe(bcd2k->dev, ep);
 	urb->instance.interval = 1;
+	urb->instance.transfer_flags |= URB_ISO_ASAP;
 	urb->instance.complete = handler;
 	urb->instance.context = urb;
-	urb->instance.number_of_packets = USB_N_PACKETS_PER_URB;
+	urb->instance.number_of_packets = USB_MAX_PACKETS_PER_URB;
 
 	return 0;
 }
 
-static void bcd2000_pcm_destroy(struct bcd2000 *bcd2k)
+static void bcd2000_pcm_free_urb(struct bcd2000 *bcd2k, struct bcd2000_urb *urb)
+{
+	if (!urb->buffer)
+		return;
+
+	if (urb->instance.transfer_flags & URB_NO_TRANSFER_DMA_MAP)
+		usb_free_coherent(bcd2k->dev, USB_BUFFER_SIZE, urb->buffer,
+						urb->buffer_dma);
+	else
+		kfree(urb->buffer);
+	urb->buffer = NULL;
+}
+
+static void bcd2000_pcm_free_stream(struct bcd2000 *bcd2k,
+					struct bcd2000_substream *stream)
 {
 	int i;
 
-	for (i = 0; i < USB_N_URBS; i++) {
-		kfree(bcd2k->pcm.playback.urbs[i].buffer);
-		#ifdef CONFIG_SND_BCD2000_CAPTURE
-		kfree(bcd2k->pcm.capture.urbs[i].buffer);
-		#endif
-	}
+	for (i = 0; i < USB_MAX_URBS; i++)
+		bcd2000_pcm_free_urb(bcd2k, &stream->urbs[i]);
+}
+
+static void bcd2000_pcm_destroy(struct bcd2000 *bcd2k)
+{
+	bcd2000_pcm_free_stream(bcd2k, &bcd2k->pcm.playback);
 }
 
 static void bcd2000_pcm_free(struct snd_pcm *pcm)
@@ -564,15 +2110,36 @@ static void bcd2000_pcm_free(struct snd_pcm *pcm)
 
 int bcd2000_init_stream(struct bcd2000 *bcd2k,struct bcd2000_substream *stream, bool in)
 {
+	struct bcd2000_client *client;
 	int i, ret;
 
 	stream->state = STREAM_DISABLED;
+	stream->in = in;
+	stream->n_urbs = USB_N_URBS;
+	stream->n_packets = USB_N_PACKETS_PER_URB;
 
-	init_waitqueue_head(&stream->wait_queue);
+	spin_lock_init(&stream->lock);
 	mutex_init(&stream->mutex);
+	INIT_DELAYED_WORK(&stream->recovery_work, bcd2000_pcm_recovery_work);
+	stream->levels = &bcd2k->pcm.levels[in ? SNDRV_PCM_STREAM_CAPTURE :
+					SNDRV_PCM_STREAM_PLAYBACK];
+
+	/* the mixed full streams followed by the stereo pairs */
+	for (i = 0; i < BCD2000_MAX_CLIENTS; i++) {
+		client = &stream->clients[i];
+		client->stream = stream;
+		if (i < BCD2000_MAX_MIX) {
+			client->channel = 0;
+			client->channels = USB_CHANNELS;
+		} else {
+			client->channel = (i - BCD2000_MAX_MIX) * 2;
+			client->channels = 2;
+		}
+		seqcount_init(&client->pos.seq);
+	}
 
-	for (i=0; i<USB_N_URBS; i++) {
-		ret = bcd2000_pcm_init_urb(&stream->urbs[i], bcd2k, in, in? 0x83 : 0x2,
+	for (i=0; i<USB_MAX_URBS; i++) {
+		ret = bcd2000_pcm_init_urb(&stream->urbs[i], bcd2k, in, in? USB_EP_AUDIO_IN : USB_EP_AUDIO_OUT,
 							 in? bcd2000_pcm_in_urb_handler : bcd2000_pcm_out_urb_handler);
 		if (ret) {
 			dev_err(&bcd2k->dev->dev, PREFIX
@@ -586,27 +2153,162 @@ int bcd2000_init_stream(struct bcd2000 *bcd2k,struct bcd2000_substream *stream,
 	return 0;
 }
 
-int bcd2000_init_audio(struct bcd2000 *bcd2k)
+/*
+ * allocate the capture stream and its URBs when the first capture substream
+ * is opened, playback-only users do not pay for it
+ */
+static int bcd2000_pcm_alloc_capture(struct bcd2000_pcm *pcm)
 {
+	struct bcd2000_substream *stream;
 	int ret;
+
+	mutex_lock(&pcm->mutex);
+	if (pcm->capture) {
+		pcm->capture_users++;
+		mutex_unlock(&pcm->mutex);
+		return 0;
+	}
+
+	stream = kzalloc(sizeof(*stream), GFP_KERNEL);
+	if (!stream) {
+		mutex_unlock(&pcm->mutex);
+		return -ENOMEM;
+	}
+
+	ret = bcd2000_init_stream(pcm->bcd2k, stream, 1);
+	if (ret) {
+		mutex_unlock(&pcm->mutex);
+		bcd2000_pcm_free_stream(pcm->bcd2k, stream);
+		kfree(stream);
+		return ret;
+	}
+
+	pcm->capture = stream;
+	pcm->capture_users = 1;
+	mutex_unlock(&pcm->mutex);
+
+	return 0;
+}
+
+/* release the capture stream after its last substream has been closed */
+static void bcd2000_pcm_release_capture(struct bcd2000_pcm *pcm)
+{
+	struct bcd2000_substream *stream = NULL;
+
+	mutex_lock(&pcm->mutex);
+	if (--pcm->capture_users == 0) {
+		stream = pcm->capture;
+		pcm->capture = NULL;
+	}
+	mutex_unlock(&pcm->mutex);
+
+	if (stream) {
+		bcd2000_pcm_free_stream(pcm->bcd2k, stream);
+		kfree(stream);
+	}
+}
+
+/* let ALSA manage the buffers of all substreams of a PCM device */
+static void bcd2000_pcm_set_buffers(struct bcd2000_pcm *pcm, struct snd_pcm *instance)
+{
+	#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+	if (pcm->zero_copy)
+		/*
+		 * the host controller has to reach the ALSA buffer directly, the
+		 * whole buffer is preallocated, so a new hw_params never frees
+		 * it under URBs that are still in flight
+		 */
+		snd_pcm_set_managed_buffer_all(instance, SNDRV_DMA_TYPE_DEV,
+					pcm->bcd2k->dev->bus->sysdev,
+					ALSA_BUFFER_SIZE, ALSA_BUFFER_SIZE);
+	else
+		snd_pcm_set_managed_buffer_all(instance, SNDRV_DMA_TYPE_VMALLOC,
+					NULL, 0, 0);
+	#elif LINUX_VERSION_CODE > KERNEL_VERSION(5,5,0)
+	snd_pcm_lib_preallocate_pages_for_all(instance, SNDRV_DMA_TYPE_VMALLOC,
+					      NULL, 0, 0);
+	#endif
+}
+
+/*
+ * add a second PCM device with a stereo substream per deck and per input,
+ * they serve the channel pairs of the USB streams
+ */
+static int bcd2000_init_pairs(struct bcd2000_pcm *pcm, bool playback, bool capture)
+{
+	static const char * const names[2][2] = {
+		[SNDRV_PCM_STREAM_PLAYBACK] = { "Deck A", "Deck B" },
+		[SNDRV_PCM_STREAM_CAPTURE] = { "Input A", "Input B" },
+	};
+	struct snd_pcm_substream *substream;
+	int i, dir, ret;
+
+	ret = snd_pcm_new(pcm->bcd2k->card, DEVICENAME " Pairs", 1,
+			playback ? 2 : 0, capture ? 2 : 0, &pcm->pairs);
+	if (ret < 0) {
+		dev_err(&pcm->bcd2k->dev->dev, PREFIX
+			"%s: snd_pcm_new() failed, ret=%d: ",
+			__func__, ret);
+		return ret;
+	}
+	pcm->pairs->private_data = pcm;
+
+	strlcpy(pcm->pairs->name, DEVICENAME " Pairs", sizeof(pcm->pairs->name));
+
+	for (dir = 0; dir < 2; dir++) {
+		substream = pcm->pairs->streams[dir].substream;
+		for (i = 0; substream; i++, substream = substream->next)
+			strlcpy(substream->name, names[dir][i], sizeof(substream->name));
+	}
+
+	if (playback)
+		snd_pcm_set_ops(pcm->pairs, SNDRV_PCM_STREAM_PLAYBACK, &bcd2000_ops);
+	if (capture)
+		snd_pcm_set_ops(pcm->pairs, SNDRV_PCM_STREAM_CAPTURE, &bcd2000_ops);
+	bcd2000_pcm_set_buffers(pcm, pcm->pairs);
+
+	return 0;
+}
+
+int bcd2000_init_audio(struct bcd2000 *bcd2k)
+{
+	int i, c, ret, n_playback;
 	struct bcd2000_pcm * pcm;
 
 	pcm = &bcd2k->pcm;
 	pcm->bcd2k = bcd2k;
 
-	spin_lock_init(&pcm->playback.lock);
-	spin_lock_init(&pcm->capture.lock);
+	n_playback = clamp_t(int, playback_substreams, 1, BCD2000_MAX_MIX);
 
-	bcd2000_init_stream(bcd2k, &pcm->playback, 0);
-	#ifdef CONFIG_SND_BCD2000_CAPTURE
-	bcd2000_init_stream(bcd2k, &pcm->capture, 1);
-	#endif
-	
-	#ifdef CONFIG_SND_BCD2000_CAPTURE
-	ret = snd_pcm_new(bcd2k->card, DEVICENAME, 0, 1, 1, &pcm->instance);
+	#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+	/*
+	 * an URB may only read from a buffer that is freed with the last
+	 * client of the stream, i.e., if no other client can be mixed in
+	 */
+	pcm->zero_copy = zero_copy && n_playback == 1 && !decks[bcd2k->card_index];
 	#else
-	ret = snd_pcm_new(bcd2k->card, DEVICENAME, 0, 1, 0, &pcm->instance);
+	pcm->zero_copy = false;
 	#endif
+
+	mutex_init(&pcm->mutex);
+
+	for (i = 0; i < 2; i++) {
+		spin_lock_init(&pcm->levels[i].lock);
+		for (c = 0; c < USB_CHANNELS; c++) {
+			pcm->levels[i].volume[c] = VOLUME_0DB;
+			pcm->levels[i].gain[c] = GAIN_UNITY;
+		}
+		pcm->levels[i].read_until = jiffies;
+	}
+
+	pcm->has_capture = capture[bcd2k->card_index] || inputs[bcd2k->card_index];
+
+	ret = bcd2000_init_stream(bcd2k, &pcm->playback, 0);
+	if (ret < 0)
+		return ret;
+
+	ret = snd_pcm_new(bcd2k->card, DEVICENAME, 0, n_playback,
+			capture[bcd2k->card_index] ? 1 : 0, &pcm->instance);
 	if (ret < 0) {
 		dev_err(&bcd2k->dev->dev, PREFIX
 			"%s: snd_pcm_new() failed, ret=%d: ",
@@ -620,22 +2322,46 @@ int bcd2000_init_audio(struct bcd2000 *bcd2k)
 
 	memcpy(&pcm->pcm_info, &bcd2000_pcm_hardware,
 		sizeof(bcd2000_pcm_hardware));
+	#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0)
+	pcm->pcm_info.info |= SNDRV_PCM_INFO_HAS_LINK_ESTIMATED_ATIME;
+	#endif
 
 	snd_pcm_set_ops(pcm->instance, SNDRV_PCM_STREAM_PLAYBACK, &bcd2000_ops);
-	#ifdef CONFIG_SND_BCD2000_CAPTURE
-	snd_pcm_set_ops(pcm->instance, SNDRV_PCM_STREAM_CAPTURE, &bcd2000_ops);
-	#endif
+	if (capture[bcd2k->card_index])
+		snd_pcm_set_ops(pcm->instance, SNDRV_PCM_STREAM_CAPTURE, &bcd2000_ops);
 
-	#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
-	snd_pcm_set_managed_buffer_all(pcm, SNDRV_DMA_TYPE_VMALLOC, NULL, 0, 0);
-	#elif LINUX_VERSION_CODE > KERNEL_VERSION(5,5,0)
-	snd_pcm_lib_preallocate_pages_for_all(pcm, SNDRV_DMA_TYPE_VMALLOC,
-					      NULL, 0, 0);
-	#endif
+	bcd2000_pcm_set_buffers(pcm, pcm->instance);
+
+	if (decks[bcd2k->card_index] || inputs[bcd2k->card_index])
+		return bcd2000_init_pairs(pcm, decks[bcd2k->card_index],
+					inputs[bcd2k->card_index]);
 
 	return 0;
 }
 
 void bcd2000_free_audio(struct bcd2000 *bcd2k)
 {
+	struct bcd2000_pcm *pcm = &bcd2k->pcm;
+
+	if (!pcm->bcd2k)
+		return;
+
+	/* coherent buffers have to be released while the device still exists */
+	pcm->panic = true;
+
+	mutex_lock(&pcm->playback.mutex);
+	bcd2000_pcm_stream_stop(pcm, &pcm->playback);
+	mutex_unlock(&pcm->playback.mutex);
+
+	/* an open capture stream itself is released on close */
+	mutex_lock(&pcm->mutex);
+	if (pcm->capture) {
+		mutex_lock(&pcm->capture->mutex);
+		bcd2000_pcm_stream_stop(pcm, pcm->capture);
+		mutex_unlock(&pcm->capture->mutex);
+		bcd2000_pcm_free_stream(bcd2k, pcm->capture);
+	}
+	mutex_unlock(&pcm->mutex);
+
+	bcd2000_pcm_destroy(bcd2k);
 }
@@ -1,58 +1,187 @@
 #ifndef AUDIO_H
 #define AUDIO_H
 
+#include <linux/cache.h>
+#include <linux/ktime.h>
+#include <linux/seqlock.h>
+#include <linux/workqueue.h>
 #include <sound/pcm.h>
 
+#define USB_EP_AUDIO_OUT 0x02
+#define USB_EP_AUDIO_IN 0x83
+
 #define USB_N_URBS 4
 #define USB_N_PACKETS_PER_URB 16
-#define USB_PACKET_SIZE 360
-#define USB_BUFFER_SIZE (USB_PACKET_SIZE * USB_N_PACKETS_PER_URB)
+#define USB_LOW_LATENCY_N_URBS 8
+#define USB_LOW_LATENCY_PACKETS_PER_URB 1
+#define USB_MAX_URBS 16
+#define USB_MAX_PACKETS_PER_URB 16
+#define USB_RECOVERY_RETRIES 10
+#define USB_RECOVERY_DELAY_MS 1
+/* longer than the longest queue of URBs takes to return */
+#define USB_DIRECT_WAIT_MS 500
+#define USB_CHANNELS 4
+#define USB_BYTES_PER_FRAME (USB_CHANNELS * 2)
+#define USB_PACKET_SIZE 360 /* maximum packet size, 45 frames */
+#define USB_PACKETS_PER_SECOND 1000
+/* frame counters of all host controllers wrap at a multiple of 256 */
+#define USB_FRAME_MASK 0xff
+
+#define PCM_RATE 44100
+/* number of packets until the 44/45 frames pattern repeats */
+#define USB_PACKETS_PER_CYCLE 10
+#define FRAMES_PER_CYCLE (PCM_RATE * USB_PACKETS_PER_CYCLE / USB_PACKETS_PER_SECOND)
+#define USB_BUFFER_SIZE (USB_PACKET_SIZE * USB_MAX_PACKETS_PER_URB)
 
 #define BYTES_PER_PERIOD 3528
 #define PERIODS_MAX 128
 #define ALSA_BUFFER_SIZE (BYTES_PER_PERIOD * PERIODS_MAX)
+/* USB frames per drift measurement */
+#define DRIFT_WINDOW 1000
+/* measurements further off are discarded, in parts per billion */
+#define DRIFT_MAX 1000000
+/* weight of a new measurement is 1/2^DRIFT_FILTER_SHIFT */
+#define DRIFT_FILTER_SHIFT 4
+/* fractional bits of the filtered drift */
+#define DRIFT_FRAC 8
+
+/* gain factors are fixed-point numbers with GAIN_SHIFT fractional bits */
+#define GAIN_SHIFT 14
+#define GAIN_UNITY (1 << GAIN_SHIFT)
+/* volume steps of 0.5 dB, starting at -60 dB */
+#define VOLUME_0DB 120
+#define VOLUME_MAX 132
+/* the meters may be skipped once nobody read them for this long */
+#define METER_IDLE_MS 1000
+/* the meters fall by 1/e within this many frames, i.e., 300 ms */
+#define METER_DECAY_FRAMES (PCM_RATE * 3 / 10)
+
+/* mixed playback substreams of the full stream */
+#define BCD2000_MAX_MIX 4
+/* the full streams and the two stereo pairs */
+#define BCD2000_MAX_CLIENTS (BCD2000_MAX_MIX + 2)
 
 struct bcd2000;
 
+/*
+ * gain and level meters of the channels of an USB stream, written by its
+ * completion handlers, hence on a cache line of its own
+ */
+struct bcd2000_levels {
+	int volume[USB_CHANNELS];
+	u32 gain[USB_CHANNELS]; /* applied by the copy pass, read locklessly */
+
+	spinlock_t lock; /* protects the meters */
+	u32 peak[USB_CHANNELS]; /* decaying highest absolute sample */
+	u32 mean_square[USB_CHANNELS]; /* decaying mean of the squared samples */
+	unsigned long read_until; /* jiffies, the meters are read until then */
+} ____cacheline_aligned_in_smp;
+
 struct bcd2000_urb {
 	struct bcd2000 *bcd2k;
 	struct bcd2000_substream *stream;
 
 	/* BEGIN DO NOT SEPARATE */
 	struct urb instance;
-	struct usb_iso_packet_descriptor packets[USB_N_PACKETS_PER_URB];
+	struct usb_iso_packet_descriptor packets[USB_MAX_PACKETS_PER_URB];
 	/* END DO NOT SEPARATE */
 	u8 *buffer;
+	dma_addr_t buffer_dma;
+	unsigned int direct_len; /* bytes sent straight from the alsa dma_area */
+	unsigned int direct_off; /* their offset in the alsa dma_area */
+	unsigned int lead_frames; /* silence in front of the frames of the clients */
+	unsigned int data_frames; /* frames taken from the alsa dma_area of each client */
+	unsigned long data_clients; /* clients the frames were taken from */
+	unsigned int rate_acc; /* fractional frames before the packets were sized */
 };
 
-struct bcd2000_substream {
-	struct snd_pcm_substream *instance;
+/* stream position published to the pointer callback */
+struct bcd2000_position {
+	seqcount_t seq;
+	unsigned int hw_off; /* bytes, the frames still owned by URBs held back */
+	unsigned int queued; /* frames queued for playback behind hw_off */
+	int last_frame;
+	u64 link_frames; /* frames of the client that passed the USB link */
+	ktime_t link_time; /* completion that brought link_frames up to date */
+};
 
-	u8 state;
+/* an ALSA substream that is fed from or into channels of an USB stream */
+struct bcd2000_client {
+	/* read locklessly by the pointer callback, written by the handlers */
+	struct bcd2000_position pos;
+
+	struct bcd2000_substream *stream;
+	unsigned int channel; /* first channel in the USB stream */
+	unsigned int channels;
+
+	/* protected by the lock of the stream */
+	struct snd_pcm_substream *instance;
 	bool active;
 	snd_pcm_uframes_t dma_off; /* current position in alsa dma_area */
 	snd_pcm_uframes_t period_off; /* current position in current period */
+	snd_pcm_uframes_t read_ptr; /* playback frames read since prepare, wraps like appl_ptr */
+	u64 link_frames; /* frames transferred since prepare */
+} ____cacheline_aligned_in_smp;
 
-	struct bcd2000_urb urbs[USB_N_URBS];
-
+struct bcd2000_substream {
+	/* state of the completion handlers, protected by lock */
+	u8 state ____cacheline_aligned_in_smp;
+	unsigned int queued; /* bytes in submitted playback URBs */
+	int last_frame; /* USB frame after the last completed URB, or -1 */
+	ktime_t last_time; /* completion of the last URB */
+	unsigned int rate_acc; /* fractional frames for the next packet */
+	unsigned int lead_frames; /* silence still to send before the first frames */
 	spinlock_t lock;
+
+	struct bcd2000_client clients[BCD2000_MAX_CLIENTS];
+	struct bcd2000_levels *levels;
+	int users; /* attached clients, protected by mutex and lock */
+	unsigned long xruns; /* playback clients to stop after an underrun */
+	unsigned int underruns; /* underruns of clients that keep running */
+
+	struct bcd2000_urb urbs[USB_MAX_URBS];
+	int n_urbs; /* URBs in flight, chosen on open */
+	int n_packets; /* packets per URB, chosen on open */
+	bool in; /* capture stream */
+	bool held; /* the alternate setting changes, the stream must not start */
+
+	struct delayed_work recovery_work;
+	unsigned long idle_urbs; /* URBs waiting for the recovery work */
+	int retries;
+	int last_error; /* last error of usb_submit_urb */
+	unsigned int recoveries; /* number of errors the stream recovered from */
+
+	/* drift of the sample clock against the host clock, protected by lock */
+	ktime_t drift_start; /* completion of the URB before the window */
+	unsigned int drift_usb_frames; /* USB frames in the window */
+	unsigned int drift_frames; /* audio frames in the window */
+	unsigned int drift_windows; /* measurements filtered so far */
+	s64 drift; /* parts per billion with DRIFT_FRAC fractional bits */
+
 	struct mutex mutex;
-	wait_queue_head_t wait_queue;
-	bool wait_cond;
-};
+} ____cacheline_aligned_in_smp;
 
 struct bcd2000_pcm {
 	struct bcd2000 *bcd2k;
 
 	struct snd_pcm *instance;
+	struct snd_pcm *pairs; /* stereo substreams per deck and input, optional */
 	struct snd_pcm_hardware pcm_info;
 
 	struct bcd2000_substream playback;
-	struct bcd2000_substream capture;
+	struct bcd2000_substream *capture; /* allocated while a substream is open */
+	int capture_users;
+	struct mutex mutex; /* protects capture */
+	struct bcd2000_levels levels[2]; /* playback and capture */
+	int drift; /* latest drift of the capture stream in parts per billion */
+	bool drift_valid; /* the capture stream runs and measured the drift */
+	bool has_capture;
 	bool panic; /* if set driver won't do anymore pcm on device */
+	bool zero_copy; /* URBs may point straight into the alsa dma_area */
 };
 
 int bcd2000_init_audio(struct bcd2000 *bcd2k);
 void bcd2000_free_audio(struct bcd2000 *bcd2k);
+unsigned long bcd2000_pcm_playback_positions(struct bcd2000 *bcd2k, u64 *frames);
 
 #endif
@@ -0,0 +1,34 @@
+#ifndef BCD2000_UAPI_H
+#define BCD2000_UAPI_H
+
+/*
+ * interface of the BCD2000 MIDI Position hwdep device, may be included by
+ * applications
+ */
+
+#include <linux/types.h>
+
+/* playback substreams with a position, see struct bcd2000_midi_event */
+#define BCD2000_MIDI_POSITIONS 6
+/* largest MIDI input packet */
+#define BCD2000_MIDI_EVENT_DATA 64
+
+/*
+ * record read from the position device for every MIDI input packet
+ *
+ * position[i] counts the frames of playback substream i that passed the USB
+ * link when the packet arrived, like the link timestamps of the substream:
+ * 0-3 are the substreams of PCM device 0 and 4 and 5 the decks on PCM
+ * device 1.
+ */
+struct bcd2000_midi_event {
+	__u64 position[BCD2000_MIDI_POSITIONS];
+	__u64 time; /* CLOCK_MONOTONIC time of the URB completion in ns */
+	__s32 usb_frame; /* USB frame number at the completion, negative if unknown */
+	__u32 active; /* bit i is set if position[i] is valid */
+	__u32 length;
+	__u32 reserved; /* zero */
+	__u8 data[BCD2000_MIDI_EVENT_DATA];
+};
+
+#endif
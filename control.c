@@ -16,6 +16,7 @@
 
 #include <linux/slab.h>
 #include <linux/interrupt.h>
+#include <linux/math64.h>
 #include <sound/control.h>
 #include <sound/tlv.h>
 
@@ -25,6 +26,8 @@
 
 static const char * const phono_mic_sw_texts[2] = { "Phono A", "Mic" };
 
+static const DECLARE_TLV_DB_SCALE(gain_tlv, -6000, 50, 1);
+
 /* 
  * switch between Phono A and Mic input using a MIDI program change command
  *
@@ -79,6 +82,210 @@ static int bcd2000_control_phono_mic_sw_get(struct snd_kcontrol *kcontrol,
 	return 0;
 }
 
+/*
+ * convert a volume in steps of 0.5 dB into the gain factor the copy pass
+ * applies, one step is a factor of 10^(1/40)
+ */
+static u32 bcd2000_control_gain(int volume)
+{
+	u64 gain = 1 << 16;
+	int i;
+
+	if (volume == 0)
+		return 0;
+
+	for (i = volume; i < VOLUME_0DB; i++)
+		gain = (gain * 61870) >> 16;
+	for (i = VOLUME_0DB; i < volume; i++)
+		gain = (gain * 69419) >> 16;
+
+	return gain >> (16 - GAIN_SHIFT);
+}
+
+static struct bcd2000_levels *bcd2000_control_levels(struct snd_kcontrol *kcontrol)
+{
+	struct bcd2000_control *ctrl = snd_kcontrol_chip(kcontrol);
+
+	return &ctrl->bcd2k->pcm.levels[kcontrol->private_value];
+}
+
+static int bcd2000_control_gain_info(struct snd_kcontrol *kcontrol,
+										  struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = USB_CHANNELS;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = VOLUME_MAX;
+
+	return 0;
+}
+
+static int bcd2000_control_gain_get(struct snd_kcontrol *kcontrol,
+										 struct snd_ctl_elem_value *ucontrol)
+{
+	struct bcd2000_levels *levels = bcd2000_control_levels(kcontrol);
+	int c;
+
+	for (c = 0; c < USB_CHANNELS; c++)
+		ucontrol->value.integer.value[c] = levels->volume[c];
+
+	return 0;
+}
+
+static int bcd2000_control_gain_put(struct snd_kcontrol *kcontrol,
+										 struct snd_ctl_elem_value *ucontrol)
+{
+	struct bcd2000_levels *levels = bcd2000_control_levels(kcontrol);
+	int c, volume, changed = 0;
+
+	for (c = 0; c < USB_CHANNELS; c++) {
+		volume = ucontrol->value.integer.value[c];
+		if (volume < 0 || volume > VOLUME_MAX)
+			return -EINVAL;
+
+		if (levels->volume[c] != volume) {
+			levels->volume[c] = volume;
+			/* the copy pass picks the new factor up with the next URB */
+			WRITE_ONCE(levels->gain[c], bcd2000_control_gain(volume));
+			changed = 1;
+		}
+	}
+
+	return changed;
+}
+
+static int bcd2000_control_meter_info(struct snd_kcontrol *kcontrol,
+										  struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = USB_CHANNELS;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = 32768;
+
+	return 0;
+}
+
+/* report the decaying peak level per channel */
+static int bcd2000_control_peak_get(struct snd_kcontrol *kcontrol,
+										 struct snd_ctl_elem_value *ucontrol)
+{
+	struct bcd2000_levels *levels = bcd2000_control_levels(kcontrol);
+	int c;
+
+	WRITE_ONCE(levels->read_until, jiffies + msecs_to_jiffies(METER_IDLE_MS));
+
+	spin_lock_irq(&levels->lock);
+	for (c = 0; c < USB_CHANNELS; c++)
+		ucontrol->value.integer.value[c] = levels->peak[c];
+	spin_unlock_irq(&levels->lock);
+
+	return 0;
+}
+
+/* report the decaying RMS level per channel */
+static int bcd2000_control_rms_get(struct snd_kcontrol *kcontrol,
+										 struct snd_ctl_elem_value *ucontrol)
+{
+	struct bcd2000_levels *levels = bcd2000_control_levels(kcontrol);
+	u32 mean_square[USB_CHANNELS];
+	int c;
+
+	WRITE_ONCE(levels->read_until, jiffies + msecs_to_jiffies(METER_IDLE_MS));
+
+	spin_lock_irq(&levels->lock);
+	for (c = 0; c < USB_CHANNELS; c++)
+		mean_square[c] = levels->mean_square[c];
+	spin_unlock_irq(&levels->lock);
+
+	for (c = 0; c < USB_CHANNELS; c++)
+		ucontrol->value.integer.value[c] = int_sqrt(mean_square[c]);
+
+	return 0;
+}
+
+static int bcd2000_control_drift_info(struct snd_kcontrol *kcontrol,
+										  struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 1;
+	uinfo->value.integer.min = -DRIFT_MAX;
+	uinfo->value.integer.max = DRIFT_MAX;
+
+	return 0;
+}
+
+/*
+ * report the drift of the sample clock against the host clock in parts per
+ * billion as measured by the capture stream, 0 while it does not run
+ */
+static int bcd2000_control_drift_get(struct snd_kcontrol *kcontrol,
+										 struct snd_ctl_elem_value *ucontrol)
+{
+	struct bcd2000_control *ctrl = snd_kcontrol_chip(kcontrol);
+	struct bcd2000_pcm *pcm = &ctrl->bcd2k->pcm;
+
+	ucontrol->value.integer.value[0] = READ_ONCE(pcm->drift_valid) ?
+		READ_ONCE(pcm->drift) : 0;
+
+	return 0;
+}
+
+/* writing 1 makes the MIDI output send the next messages even if they repeat */
+static int bcd2000_control_resync_get(struct snd_kcontrol *kcontrol,
+										 struct snd_ctl_elem_value *ucontrol)
+{
+	ucontrol->value.integer.value[0] = 0;
+
+	return 0;
+}
+
+static int bcd2000_control_resync_put(struct snd_kcontrol *kcontrol,
+										 struct snd_ctl_elem_value *ucontrol)
+{
+	struct bcd2000_control *ctrl = snd_kcontrol_chip(kcontrol);
+
+	if (ucontrol->value.integer.value[0])
+		bcd2000_midi_resync(ctrl->bcd2k);
+
+	return 0;
+}
+
+#define BCD2000_LEVEL_CONTROLS(dir, prefix) \
+	{ \
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER, \
+		.name = prefix " Volume", \
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE | \
+				SNDRV_CTL_ELEM_ACCESS_TLV_READ, \
+		.info = bcd2000_control_gain_info, \
+		.get = bcd2000_control_gain_get, \
+		.put = bcd2000_control_gain_put, \
+		.tlv = { .p = gain_tlv }, \
+		.private_value = dir \
+	}, \
+	{ \
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER, \
+		.name = prefix " Peak Meter", \
+		.access = SNDRV_CTL_ELEM_ACCESS_READ | \
+				SNDRV_CTL_ELEM_ACCESS_VOLATILE, \
+		.info = bcd2000_control_meter_info, \
+		.get = bcd2000_control_peak_get, \
+		.private_value = dir \
+	}, \
+	{ \
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER, \
+		.name = prefix " RMS Meter", \
+		.access = SNDRV_CTL_ELEM_ACCESS_READ | \
+				SNDRV_CTL_ELEM_ACCESS_VOLATILE, \
+		.info = bcd2000_control_meter_info, \
+		.get = bcd2000_control_rms_get, \
+		.private_value = dir \
+	}
+
+static struct snd_kcontrol_new capture_elements[] = {
+	BCD2000_LEVEL_CONTROLS(SNDRV_PCM_STREAM_CAPTURE, "Capture"),
+	{}
+};
+
 static struct snd_kcontrol_new elements[] = {
 	{
 		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
@@ -89,18 +296,34 @@ static struct snd_kcontrol_new elements[] = {
 		.get = bcd2000_control_phono_mic_sw_get,
 		.put = bcd2000_control_phono_mic_sw_put
 	},
+	BCD2000_LEVEL_CONTROLS(SNDRV_PCM_STREAM_PLAYBACK, "PCM Playback"),
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+		.name = "Sample Clock Drift",
+		.access = SNDRV_CTL_ELEM_ACCESS_READ |
+				SNDRV_CTL_ELEM_ACCESS_VOLATILE,
+		.info = bcd2000_control_drift_info,
+		.get = bcd2000_control_drift_get
+	},
+	{
+		.iface = SNDRV_CTL_ELEM_IFACE_RAWMIDI,
+		.name = "MIDI Output Resync Switch",
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = snd_ctl_boolean_mono_info,
+		.get = bcd2000_control_resync_get,
+		.put = bcd2000_control_resync_put
+	},
 	{}
 };
 
-int bcd2000_init_control(struct bcd2000 *bcd2k)
+static int bcd2000_add_controls(struct bcd2000 *bcd2k,
+				const struct snd_kcontrol_new *controls)
 {
 	int i, ret;
 
-	bcd2k->control.bcd2k = bcd2k;
-
 	i = 0;
-	while (elements[i].name) {
-		ret = snd_ctl_add(bcd2k->card, snd_ctl_new1(&elements[i],
+	while (controls[i].name) {
+		ret = snd_ctl_add(bcd2k->card, snd_ctl_new1(&controls[i],
 													&bcd2k->control));
 		if (ret < 0) {
 			dev_err(&bcd2k->dev->dev, "cannot add control\n");
@@ -112,6 +335,22 @@ int bcd2000_init_control(struct bcd2000 *bcd2k)
 	return 0;
 }
 
+int bcd2000_init_control(struct bcd2000 *bcd2k)
+{
+	int ret;
+
+	bcd2k->control.bcd2k = bcd2k;
+
+	ret = bcd2000_add_controls(bcd2k, elements);
+	if (ret < 0)
+		return ret;
+
+	if (bcd2k->pcm.has_capture)
+		return bcd2000_add_controls(bcd2k, capture_elements);
+
+	return 0;
+}
+
 void bcd2000_free_control(struct bcd2000 *bcd2k)
 {
 }
\ No newline at end of file
@@ -14,6 +14,10 @@
  *   GNU General Public License for more details.
  */
 
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+
 #include "bcd2000.h"
 #include "midi.h"
 
@@ -55,6 +59,11 @@ static unsigned char bcd2000_init_sequence[] = {
 
 static unsigned char device_cmd_prefix[] = MIDI_CMD_PREFIX_INIT;
 
+static int midi_in_urbs = MIDI_N_IN_URBS;
+module_param(midi_in_urbs, int, 0444);
+MODULE_PARM_DESC(midi_in_urbs, "Number of MIDI input URBs in flight (1-"
+		__stringify(MIDI_MAX_IN_URBS) ")");
+
 static int bcd2000_midi_input_open(struct snd_rawmidi_substream *substream)
 {
 	return 0;
@@ -73,17 +82,56 @@ static void bcd2000_midi_input_trigger(struct snd_rawmidi_substream *substream,
 	bcd2k->midi.receive_substream = up ? substream : NULL;
 }
 
-static void bcd2000_midi_handle_input(struct bcd2000 *bcd2k,
-				const unsigned char *buf, unsigned int buf_len)
+/*
+ * tag the payload of an input URB with the playback position, the completion
+ * time and the USB frame for the position device, all events of a packet
+ * arrived in the same USB frame
+ */
+static void bcd2000_midi_sync_event(struct bcd2000 *bcd2k,
+				const unsigned char *buf, unsigned int len,
+				ktime_t time, int usb_frame)
 {
-	unsigned int payload_length, tocopy;
-	struct snd_rawmidi_substream *receive_substream;
+	struct bcd2000_midi *midi = &bcd2k->midi;
+	struct bcd2000_midi_event event;
 
-	receive_substream = READ_ONCE(bcd2k->midi.receive_substream);
-	if (!receive_substream)
+	/* the records are fixed by bcd2000_uapi.h */
+	BUILD_BUG_ON(BCD2000_MIDI_POSITIONS != BCD2000_MAX_CLIENTS);
+	BUILD_BUG_ON(BCD2000_MIDI_EVENT_DATA < MIDI_URB_BUFSIZE);
+
+	if (!READ_ONCE(midi->sync_open))
 		return;
 
-	bcd2000_dump_buffer(PREFIX "received from device: ", buf, buf_len);
+	event.active = bcd2000_pcm_playback_positions(bcd2k, event.position);
+	event.time = ktime_to_ns(time);
+	event.usb_frame = usb_frame;
+	event.length = len;
+	event.reserved = 0;
+	memcpy(event.data, buf, len);
+	memset(event.data + len, 0, sizeof(event.data) - len);
+
+	/* a reader that falls behind loses the newest packets */
+	if (!kfifo_in_spinlocked(&midi->sync_fifo, &event, 1, &midi->sync_lock))
+		dev_dbg_ratelimited(&bcd2k->dev->dev, PREFIX
+				"position device overrun\n");
+
+	wake_up_interruptible(&midi->sync_wait);
+}
+
+/*
+ * pass the payload of an input URB to rawmidi and the position device
+ *
+ * In the framing mode of rawmidi (SNDRV_RAWMIDI_MODE_FRAMING_TSTAMP, Linux
+ * 5.14 and later) snd_rawmidi_receive() stamps the events with the time of
+ * the call, there is no way to hand over a timestamp of our own. Hence the
+ * events are passed on before anything else is done with the URB, and the
+ * completion time and USB frame go to the position device.
+ */
+static void bcd2000_midi_handle_input(struct bcd2000 *bcd2k,
+				const unsigned char *buf, unsigned int buf_len,
+				ktime_t time, int usb_frame)
+{
+	unsigned int payload_length, tocopy;
+	struct snd_rawmidi_substream *receive_substream;
 
 	if (buf_len < 2)
 		return;
@@ -96,72 +144,243 @@ static void bcd2000_midi_handle_input(struct bcd2000 *bcd2k,
 
 	tocopy = min(payload_length, buf_len-1);
 
-	bcd2000_dump_buffer(PREFIX "sending to userspace: ",
+	receive_substream = READ_ONCE(bcd2k->midi.receive_substream);
+	if (receive_substream)
+		snd_rawmidi_receive(receive_substream,
 					&buf[1], tocopy);
 
-	snd_rawmidi_receive(receive_substream,
+	bcd2000_midi_sync_event(bcd2k, &buf[1], tocopy, time, usb_frame);
+
+	bcd2000_dump_buffer(PREFIX "received from device: ", buf, buf_len);
+	bcd2000_dump_buffer(PREFIX "sent to userspace: ",
 					&buf[1], tocopy);
 }
 
-static void bcd2000_midi_send(struct bcd2000 *bcd2k)
+/* forget the state of the device, called with the output lock held */
+static void bcd2000_midi_reset_shadow(struct bcd2000_midi *midi)
 {
-	int len, ret;
-	struct snd_rawmidi_substream *send_substream;
+	memset(midi->shadow_notes, MIDI_UNKNOWN, sizeof(midi->shadow_notes));
+	memset(midi->shadow_controls, MIDI_UNKNOWN, sizeof(midi->shadow_controls));
+}
 
-	BUILD_BUG_ON(sizeof(device_cmd_prefix) >= MIDI_URB_BUFSIZE);
+/* drop a partial message, called with the output lock held */
+static void bcd2000_midi_reset_parser(struct bcd2000_midi *midi)
+{
+	midi->out_status = 0;
+	midi->out_count = 0;
+}
 
-	send_substream = READ_ONCE(bcd2k->midi.send_substream);
-	if (!send_substream)
-		return;
+/* let the next messages reach the device even if they repeat the last ones */
+void bcd2000_midi_resync(struct bcd2000 *bcd2k)
+{
+	unsigned long flags;
 
-	/* copy command prefix bytes */
-	memcpy(bcd2k->midi.out_buffer, device_cmd_prefix,
-			sizeof(device_cmd_prefix));
+	spin_lock_irqsave(&bcd2k->midi.out_lock, flags);
+	bcd2000_midi_reset_shadow(&bcd2k->midi);
+	spin_unlock_irqrestore(&bcd2k->midi.out_lock, flags);
+}
+
+/*
+ * feed a byte of the output through the parser, called with the output lock
+ * held
+ *
+ * Note on, note off and control change messages are held back until they are
+ * complete and dropped if they would not change the state of the device,
+ * i.e., the LEDs. Everything else is passed on as is.
+ *
+ * Returns the number of bytes written to out, at most 3.
+ */
+static int bcd2000_midi_filter(struct bcd2000_midi *midi, u8 byte, u8 *out)
+{
+	u8 *shadow, value;
+	bool mode;
+
+	/* real-time messages may appear anywhere */
+	if (byte >= 0xf8) {
+		out[0] = byte;
+		return 1;
+	}
+
+	if (byte & 0x80) {
+		midi->out_count = 0;
+
+		switch (byte & 0xf0) {
+		case 0x80:
+		case 0x90:
+		case 0xb0:
+			midi->out_status = byte;
+			return 0;
+		default:
+			/* other messages and their data bytes are not filtered */
+			midi->out_status = 0;
+			out[0] = byte;
+			return 1;
+		}
+	}
+
+	if (!midi->out_status) {
+		out[0] = byte;
+		return 1;
+	}
+
+	midi->out_data[midi->out_count++] = byte;
+	if (midi->out_count < 2)
+		return 0;
+	midi->out_count = 0;
+
+	if ((midi->out_status & 0xf0) == 0xb0) {
+		shadow = &midi->shadow_controls[midi->out_status & 0x0f][midi->out_data[0]];
+		value = midi->out_data[1];
+	} else {
+		/* a note on with velocity 0 is a note off */
+		shadow = &midi->shadow_notes[midi->out_status & 0x0f][midi->out_data[0]];
+		value = (midi->out_status & 0xf0) == 0x90 ? midi->out_data[1] : 0;
+	}
 
 	/*
-	 * get MIDI packet and leave space for command prefix
-	 * and payload length
+	 * channel mode messages, i.e., controllers 0x78 to 0x7f, act on the whole
+	 * device instead of a single LED and are never dropped
 	 */
-	len = snd_rawmidi_transmit(send_substream,
-							   bcd2k->midi.out_buffer + 3, MIDI_URB_BUFSIZE - 3);
+	mode = (midi->out_status & 0xf0) == 0xb0 && midi->out_data[0] >= 0x78;
+	if (*shadow == value && !mode)
+		return 0;
+	*shadow = value;
+
+	/* the status is repeated, so the device never depends on running status */
+	out[0] = midi->out_status;
+	out[1] = midi->out_data[0];
+	out[2] = midi->out_data[1];
+	return 3;
+}
 
-	if (len < 0)
-		dev_err(&bcd2k->dev->dev, "%s: snd_rawmidi_transmit error %d\n",
-				__func__, len);
+/*
+ * take the pending output from rawmidi and pack it into an URB buffer, called
+ * with the output lock held
+ *
+ * Returns the number of bytes in buf, which may be 0 if all pending messages
+ * were redundant, or a negative error code.
+ */
+static int bcd2000_midi_pack(struct bcd2000_midi *midi,
+				struct snd_rawmidi_substream *substream,
+				u8 *buf, int size)
+{
+	u8 in[MIDI_URB_BUFSIZE / 3];
+	int i, n, len = 0;
 
-	if (len <= 0)
-		return;
+	/* a byte yields at most 3 bytes, so whatever is taken fits */
+	while (size - len >= 3) {
+		n = snd_rawmidi_transmit_peek(substream, in,
+					min_t(int, (size - len) / 3, sizeof(in)));
+		if (n <= 0)
+			return len ? len : n;
 
-	/* set payload length */
-	bcd2k->midi.out_buffer[2] = len;
-	bcd2k->midi.out_urb->transfer_buffer_length = MIDI_URB_BUFSIZE;
+		for (i = 0; i < n; i++)
+			len += bcd2000_midi_filter(midi, in[i], buf + len);
 
-	bcd2000_dump_buffer(PREFIX "sending to device: ",
-						bcd2k->midi.out_buffer, len+3);
+		snd_rawmidi_transmit_ack(substream, n);
+	}
 
-	/* send packet to the BCD2000 */
-	ret = usb_submit_urb(bcd2k->midi.out_urb, GFP_ATOMIC);
-	if (ret < 0)
-		dev_err(&bcd2k->dev->dev, PREFIX
-			"%s (%p): usb_submit_urb() failed, ret=%d, len=%d\n",
-			__func__, send_substream, ret, len);
-	else
-		bcd2k->midi.out_active = 1;
+	return len;
+}
+
+/*
+ * fill the idle output URBs from the rawmidi buffer and submit them
+ *
+ * Every URB carries as many bytes as are pending, up to its size. All URBs
+ * are kept in flight while there is data, so the device gets a new transfer
+ * in every interval instead of waiting for the completion of the previous
+ * one. The USB core keeps the URBs of an endpoint in the order they were
+ * submitted.
+ */
+static void bcd2000_midi_send(struct bcd2000 *bcd2k)
+{
+	int i, len, ret;
+	unsigned long flags;
+	unsigned char *buf;
+	struct urb *urb;
+	struct bcd2000_midi *midi = &bcd2k->midi;
+	struct snd_rawmidi_substream *send_substream;
+
+	BUILD_BUG_ON(sizeof(device_cmd_prefix) >= MIDI_URB_BUFSIZE);
+
+	send_substream = READ_ONCE(midi->send_substream);
+	if (!send_substream)
+		return;
+
+	spin_lock_irqsave(&midi->out_lock, flags);
+
+	while (midi->out_idle) {
+		i = __ffs(midi->out_idle);
+		urb = midi->out_urbs[i];
+		buf = midi->out_buffers[i];
+
+		/* copy command prefix bytes */
+		memcpy(buf, device_cmd_prefix, sizeof(device_cmd_prefix));
+
+		/*
+		 * get MIDI packet and leave space for command prefix
+		 * and payload length
+		 */
+		len = bcd2000_midi_pack(midi, send_substream,
+								buf + 3, MIDI_URB_BUFSIZE - 3);
+
+		if (len < 0)
+			dev_err(&bcd2k->dev->dev, "%s: snd_rawmidi_transmit error %d\n",
+					__func__, len);
+
+		if (len <= 0)
+			break;
+
+		/* set payload length */
+		buf[2] = len;
+		urb->transfer_buffer_length = MIDI_URB_BUFSIZE;
+
+		bcd2000_dump_buffer(PREFIX "sending to device: ", buf, len+3);
+
+		/* send packet to the BCD2000, the anchor holds it until it returns */
+		usb_anchor_urb(urb, &midi->anchor);
+		ret = usb_submit_urb(urb, GFP_ATOMIC);
+		if (ret < 0) {
+			usb_unanchor_urb(urb);
+			/* the shadow already holds what got lost */
+			bcd2000_midi_reset_shadow(midi);
+			dev_err(&bcd2k->dev->dev, PREFIX
+				"%s (%p): usb_submit_urb() failed, ret=%d, len=%d\n",
+				__func__, send_substream, ret, len);
+			break;
+		}
+
+		midi->out_idle &= ~BIT(i);
+	}
+
+	spin_unlock_irqrestore(&midi->out_lock, flags);
 }
 
 static int bcd2000_midi_output_open(struct snd_rawmidi_substream *substream)
 {
+	struct bcd2000 *bcd2k = substream->rmidi->private_data;
+	unsigned long flags;
+
+	/*
+	 * the first state a new application sends always reaches the device and
+	 * a message the last one left unfinished is not completed by it
+	 */
+	spin_lock_irqsave(&bcd2k->midi.out_lock, flags);
+	bcd2000_midi_reset_shadow(&bcd2k->midi);
+	bcd2000_midi_reset_parser(&bcd2k->midi);
+	spin_unlock_irqrestore(&bcd2k->midi.out_lock, flags);
+
 	return 0;
 }
 
 static int bcd2000_midi_output_close(struct snd_rawmidi_substream *substream)
 {
 	struct bcd2000 *bcd2k = substream->rmidi->private_data;
+	int i;
 
-	if (bcd2k->midi.out_active) {
-		usb_kill_urb(bcd2k->midi.out_urb);
-		bcd2k->midi.out_active = 0;
-	}
+	/* URBs that are not in flight are skipped */
+	for (i = 0; i < MIDI_N_OUT_URBS; i++)
+		usb_kill_urb(bcd2k->midi.out_urbs[i]);
 
 	return 0;
 }
@@ -175,8 +394,7 @@ static void bcd2000_midi_output_trigger(struct snd_rawmidi_substream *substream,
 	if (up) {
 		bcd2k->midi.send_substream = substream;
 		/* check if there is data userspace wants to send */
-		if (!bcd2k->midi.out_active)
-			bcd2000_midi_send(bcd2k);
+		bcd2000_midi_send(bcd2k);
 	} else {
 		bcd2k->midi.send_substream = NULL;
 	}
@@ -185,8 +403,18 @@ static void bcd2000_midi_output_trigger(struct snd_rawmidi_substream *substream,
 static void bcd2000_output_complete(struct urb *urb)
 {
 	struct bcd2000 *bcd2k = urb->context;
-
-	bcd2k->midi.out_active = 0;
+	struct bcd2000_midi *midi = &bcd2k->midi;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&midi->out_lock, flags);
+	for (i = 0; i < MIDI_N_OUT_URBS; i++)
+		if (midi->out_urbs[i] == urb)
+			midi->out_idle |= BIT(i);
+	/* the device may have missed messages the shadow holds */
+	if (urb->status)
+		bcd2000_midi_reset_shadow(midi);
+	spin_unlock_irqrestore(&midi->out_lock, flags);
 
 	if (urb->status)
 		dev_warn(&urb->dev->dev,
@@ -199,10 +427,24 @@ static void bcd2000_output_complete(struct urb *urb)
 	bcd2000_midi_send(bcd2k);
 }
 
+/*
+ * handle the data of an input URB and return it to the device
+ *
+ * The other input URBs keep polling the device meanwhile. The host
+ * controller gives the URBs of an endpoint back in the order they were
+ * submitted, hence the data reaches rawmidi in order.
+ */
 static void bcd2000_input_complete(struct urb *urb)
 {
 	int ret;
 	struct bcd2000 *bcd2k = urb->context;
+	ktime_t time = ktime_get();
+
+	/* rawmidi stamps the events when they are handed over */
+	if (bcd2k && !urb->status && urb->actual_length > 0)
+		bcd2000_midi_handle_input(bcd2k, urb->transfer_buffer,
+					urb->actual_length, time,
+					usb_get_current_frame_number(bcd2k->dev));
 
 	if (urb->status)
 		dev_warn(&urb->dev->dev,
@@ -211,18 +453,97 @@ static void bcd2000_input_complete(struct urb *urb)
 	if (!bcd2k || urb->status == -ESHUTDOWN)
 		return;
 
-	if (urb->actual_length > 0)
-		bcd2000_midi_handle_input(bcd2k, urb->transfer_buffer,
-					urb->actual_length);
-
 	/* return URB to device */
-	ret = usb_submit_urb(bcd2k->midi.in_urb, GFP_ATOMIC);
+	ret = usb_submit_urb(urb, GFP_ATOMIC);
 	if (ret < 0)
 		dev_err(&bcd2k->dev->dev, PREFIX
 			"%s: usb_submit_urb() failed, ret=%d\n",
 			__func__, ret);
 }
 
+static int bcd2000_midi_sync_open(struct snd_hwdep *hw, struct file *file)
+{
+	struct bcd2000_midi *midi = &((struct bcd2000 *) hw->private_data)->midi;
+	unsigned long flags;
+
+	/* the device is exclusive, nobody reads the old packets anymore */
+	spin_lock_irqsave(&midi->sync_lock, flags);
+	kfifo_reset(&midi->sync_fifo);
+	midi->sync_open = true;
+	spin_unlock_irqrestore(&midi->sync_lock, flags);
+
+	/* hwdep passes no file to read, so the mode of the open is kept */
+	midi->sync_nonblock = file->f_flags & O_NONBLOCK;
+
+	return 0;
+}
+
+static int bcd2000_midi_sync_release(struct snd_hwdep *hw, struct file *file)
+{
+	struct bcd2000_midi *midi = &((struct bcd2000 *) hw->private_data)->midi;
+
+	WRITE_ONCE(midi->sync_open, false);
+
+	return 0;
+}
+
+/*
+ * read whole struct bcd2000_midi_event records, blocks until one is ready
+ * unless the device was opened with O_NONBLOCK
+ */
+static long bcd2000_midi_sync_read(struct snd_hwdep *hw, char __user *buf,
+					long count, loff_t *offset)
+{
+	struct bcd2000_midi *midi = &((struct bcd2000 *) hw->private_data)->midi;
+	struct bcd2000_midi_event event;
+	long n = 0;
+	int ret;
+
+	if (count < sizeof(event))
+		return -EINVAL;
+
+	if (READ_ONCE(midi->sync_disconnected))
+		return -ENODEV;
+
+	if (kfifo_is_empty(&midi->sync_fifo) && midi->sync_nonblock)
+		return -EAGAIN;
+
+	ret = wait_event_interruptible(midi->sync_wait,
+					!kfifo_is_empty(&midi->sync_fifo) ||
+					READ_ONCE(midi->sync_disconnected));
+	if (ret < 0)
+		return ret;
+
+	if (READ_ONCE(midi->sync_disconnected))
+		return -ENODEV;
+
+	while (count - n >= sizeof(event) && kfifo_get(&midi->sync_fifo, &event)) {
+		if (copy_to_user(buf + n, &event, sizeof(event)))
+			return -EFAULT;
+		n += sizeof(event);
+	}
+
+	return n;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,16,0)
+static __poll_t bcd2000_midi_sync_poll(struct snd_hwdep *hw, struct file *file,
+					poll_table *wait)
+#else
+static unsigned int bcd2000_midi_sync_poll(struct snd_hwdep *hw, struct file *file,
+					poll_table *wait)
+#endif
+{
+	struct bcd2000_midi *midi = &((struct bcd2000 *) hw->private_data)->midi;
+
+	poll_wait(file, &midi->sync_wait, wait);
+
+	if (READ_ONCE(midi->sync_disconnected))
+		return POLLERR | POLLHUP;
+
+	return kfifo_is_empty(&midi->sync_fifo) ? 0 : POLLIN | POLLRDNORM;
+}
+
 static struct snd_rawmidi_ops bcd2000_midi_output = {
 	.open =    bcd2000_midi_output_open,
 	.close =   bcd2000_midi_output_close,
@@ -237,9 +558,19 @@ static struct snd_rawmidi_ops bcd2000_midi_input = {
 
 int bcd2000_init_midi(struct bcd2000 *bcd2k)
 {
-	int ret;
+	int i, ret;
 	struct snd_rawmidi *rmidi;
-	struct bcd2000_midi *midi;
+	struct bcd2000_midi *midi = &bcd2k->midi;
+
+	/* the teardown relies on both even if the initialization fails */
+	spin_lock_init(&midi->out_lock);
+	init_usb_anchor(&midi->anchor);
+	bcd2000_midi_reset_shadow(midi);
+	bcd2000_midi_reset_parser(midi);
+
+	spin_lock_init(&midi->sync_lock);
+	init_waitqueue_head(&midi->sync_wait);
+	INIT_KFIFO(midi->sync_fifo);
 
 	ret = snd_rawmidi_new(bcd2k->card, bcd2k->card->shortname, 0,
 					1, /* output */
@@ -262,50 +593,80 @@ int bcd2000_init_midi(struct bcd2000 *bcd2k)
 	snd_rawmidi_set_ops(rmidi, SNDRV_RAWMIDI_STREAM_INPUT,
 					&bcd2000_midi_input);
 
-	midi = &bcd2k->midi;
 	midi->rmidi = rmidi;
 
-	midi->in_urb = usb_alloc_urb(0, GFP_KERNEL);
-	midi->out_urb = usb_alloc_urb(0, GFP_KERNEL);
+	/* MIDI input tagged with the playback position */
+	ret = snd_hwdep_new(bcd2k->card, "BCD2000 Position", 0, &midi->hwdep);
+	if (ret < 0)
+		return ret;
 
-	if (!midi->in_urb || !midi->out_urb) {
-		dev_err(&bcd2k->dev->dev, PREFIX "usb_alloc_urb failed\n");
-		return -ENOMEM;
+	strlcpy(midi->hwdep->name, DEVICENAME " MIDI Position",
+		sizeof(midi->hwdep->name));
+	midi->hwdep->private_data = bcd2k;
+	midi->hwdep->exclusive = 1;
+	midi->hwdep->ops.open = bcd2000_midi_sync_open;
+	midi->hwdep->ops.release = bcd2000_midi_sync_release;
+	midi->hwdep->ops.read = bcd2000_midi_sync_read;
+	midi->hwdep->ops.poll = bcd2000_midi_sync_poll;
+
+	midi->n_in_urbs = clamp(midi_in_urbs, 1, MIDI_MAX_IN_URBS);
+	for (i = 0; i < midi->n_in_urbs; i++) {
+		midi->in_urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+		if (!midi->in_urbs[i]) {
+			dev_err(&bcd2k->dev->dev, PREFIX "usb_alloc_urb failed\n");
+			return -ENOMEM;
+		}
+
+		usb_fill_int_urb(midi->in_urbs[i], bcd2k->dev,
+					usb_rcvintpipe(bcd2k->dev, MIDI_EP_IN),
+					midi->in_buffers[i], MIDI_URB_BUFSIZE,
+					bcd2000_input_complete, bcd2k, 1);
 	}
 
-	usb_fill_int_urb(midi->in_urb, bcd2k->dev,
-				usb_rcvintpipe(bcd2k->dev, 0x81),
-				midi->in_buffer, MIDI_URB_BUFSIZE,
-				bcd2000_input_complete, bcd2k, 1);
-
-	usb_fill_int_urb(midi->out_urb, bcd2k->dev,
-				usb_sndintpipe(bcd2k->dev, 0x1),
-				midi->out_buffer, MIDI_URB_BUFSIZE,
-				bcd2000_output_complete, bcd2k, 1);
+	for (i = 0; i < MIDI_N_OUT_URBS; i++) {
+		midi->out_urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+		if (!midi->out_urbs[i]) {
+			dev_err(&bcd2k->dev->dev, PREFIX "usb_alloc_urb failed\n");
+			return -ENOMEM;
+		}
+
+		usb_fill_int_urb(midi->out_urbs[i], bcd2k->dev,
+					usb_sndintpipe(bcd2k->dev, MIDI_EP_OUT),
+					midi->out_buffers[i], MIDI_URB_BUFSIZE,
+					bcd2000_output_complete, bcd2k, 1);
+	}
+	midi->out_idle = BIT(MIDI_N_OUT_URBS) - 1;
 
-	init_usb_anchor(&midi->anchor);
-	usb_anchor_urb(midi->out_urb, &midi->anchor);
-	usb_anchor_urb(midi->in_urb, &midi->anchor);
+	usb_anchor_urb(midi->out_urbs[0], &midi->anchor);
+	/* the first input URB receives the answer to the init sequence */
+	usb_anchor_urb(midi->in_urbs[0], &midi->anchor);
 
 	/* copy init sequence into buffer */
-	memcpy(midi->out_buffer, bcd2000_init_sequence, 52);
-	midi->out_urb->transfer_buffer_length = 52;
+	memcpy(midi->out_buffers[0], bcd2000_init_sequence, 52);
+	midi->out_urbs[0]->transfer_buffer_length = 52;
 
 	/* submit sequence */
-	ret = usb_submit_urb(midi->out_urb, GFP_KERNEL);
-	if (ret < 0)
+	ret = usb_submit_urb(midi->out_urbs[0], GFP_KERNEL);
+	if (ret < 0) {
+		usb_unanchor_urb(midi->out_urbs[0]);
 		dev_err(&bcd2k->dev->dev, PREFIX
 			"%s: usb_submit_urb() out failed, ret=%d: ",
 			__func__, ret);
-	else
-		midi->out_active = 1;
+	} else {
+		midi->out_idle &= ~BIT(0);
+	}
 
-	/* pass URB to device to enable button and controller events */
-	ret = usb_submit_urb(midi->in_urb, GFP_KERNEL);
-	if (ret < 0)
-		dev_err(&bcd2k->dev->dev, PREFIX
-			"%s: usb_submit_urb() in failed, ret=%d: ",
-			__func__, ret);
+	/* pass URBs to device to enable button and controller events */
+	for (i = 0; i < midi->n_in_urbs; i++) {
+		ret = usb_submit_urb(midi->in_urbs[i], GFP_KERNEL);
+		if (ret < 0) {
+			if (!i)
+				usb_unanchor_urb(midi->in_urbs[0]);
+			dev_err(&bcd2k->dev->dev, PREFIX
+				"%s: usb_submit_urb() in failed, ret=%d: ",
+				__func__, ret);
+		}
+	}
 
 	/* ensure initialization is finished */
 	usb_wait_anchor_empty_timeout(&midi->anchor, 1000);
@@ -313,9 +674,37 @@ int bcd2000_init_midi(struct bcd2000 *bcd2k)
 	return 0;
 }
 
+/* resubmit the input URBs after the endpoints of the interface were reset */
+void bcd2000_midi_resume_input(struct bcd2000 *bcd2k)
+{
+	int i, ret;
+
+	for (i = 0; i < bcd2k->midi.n_in_urbs; i++) {
+		ret = usb_submit_urb(bcd2k->midi.in_urbs[i], GFP_KERNEL);
+		if (ret < 0)
+			dev_err(&bcd2k->dev->dev, PREFIX
+				"%s: usb_submit_urb() failed, ret=%d\n",
+				__func__, ret);
+	}
+}
+
 void bcd2000_free_midi(struct bcd2000 *bcd2k)
 {
-	/* usb_kill_urb not necessary, urb is aborted automatically */
-	usb_free_urb(bcd2k->midi.out_urb);
-	usb_free_urb(bcd2k->midi.in_urb);
+	int i;
+
+	/* readers of the position device must not wait for the next packet */
+	WRITE_ONCE(bcd2k->midi.sync_disconnected, true);
+	wake_up_interruptible(&bcd2k->midi.sync_wait);
+
+	/* the output URBs still in flight are anchored */
+	usb_kill_anchored_urbs(&bcd2k->midi.anchor);
+
+	for (i = 0; i < MIDI_N_OUT_URBS; i++)
+		usb_free_urb(bcd2k->midi.out_urbs[i]);
+
+	/* the input URBs are resubmitted by their handler */
+	for (i = 0; i < MIDI_MAX_IN_URBS; i++) {
+		usb_kill_urb(bcd2k->midi.in_urbs[i]);
+		usb_free_urb(bcd2k->midi.in_urbs[i]);
+	}
 }
@@ -1,10 +1,27 @@
 #ifndef MIDI_H
 #define MIDI_H
 
+#include <linux/kfifo.h>
+#include <linux/wait.h>
+#include <sound/hwdep.h>
 #include <sound/rawmidi.h>
 
+#include "audio.h"
+#include "bcd2000_uapi.h"
+
+#define MIDI_EP_IN 0x81
+#define MIDI_EP_OUT 0x01
 #define MIDI_URB_BUFSIZE 64
+/* output URBs in flight, the device takes one per 1 ms interval */
+#define MIDI_N_OUT_URBS 8
+/* input URBs polling the device, so it never finds the endpoint idle */
+#define MIDI_N_IN_URBS 4
+#define MIDI_MAX_IN_URBS 8
 #define MIDI_CMD_PREFIX_INIT {0x03, 0x00}
+/* input packets buffered for the position device, a power of 2 */
+#define MIDI_SYNC_EVENTS 64
+/* shadow value of a note or controller whose state is unknown */
+#define MIDI_UNKNOWN 0xff
 
 struct bcd2000;
 
@@ -13,21 +30,43 @@ struct bcd2000;
 struct bcd2000_midi {
 	struct bcd2000 *bcd2k;
 
-	int out_active;
 	struct snd_rawmidi *rmidi;
 	struct snd_rawmidi_substream *receive_substream;
 	struct snd_rawmidi_substream *send_substream;
 
-	unsigned char in_buffer[MIDI_URB_BUFSIZE];
-	unsigned char out_buffer[MIDI_URB_BUFSIZE];
+	unsigned char in_buffers[MIDI_MAX_IN_URBS][MIDI_URB_BUFSIZE];
+	unsigned char out_buffers[MIDI_N_OUT_URBS][MIDI_URB_BUFSIZE];
+
+	struct urb *out_urbs[MIDI_N_OUT_URBS];
+	unsigned long out_idle; /* output URBs that can be filled */
+	spinlock_t out_lock; /* protects out_idle, the parser and the shadow */
+
+	/* output parser, keeps a note or control change until it is complete */
+	u8 out_status; /* running status, 0 if the data bytes are passed on */
+	u8 out_data[2];
+	int out_count; /* data bytes of the current message */
+
+	/* last value sent per channel and note or controller, MIDI_UNKNOWN if none */
+	u8 shadow_notes[16][128];
+	u8 shadow_controls[16][128];
+	struct urb *in_urbs[MIDI_MAX_IN_URBS];
+	int n_in_urbs; /* chosen on probe */
 
-	struct urb *out_urb;
-	struct urb *in_urb;
+	/* input packets tagged with the playback position */
+	struct snd_hwdep *hwdep;
+	bool sync_open;
+	bool sync_nonblock; /* opened with O_NONBLOCK */
+	bool sync_disconnected; /* the device is gone, reads fail */
+	DECLARE_KFIFO(sync_fifo, struct bcd2000_midi_event, MIDI_SYNC_EVENTS);
+	spinlock_t sync_lock; /* protects writing to sync_fifo */
+	wait_queue_head_t sync_wait;
 
 	struct usb_anchor anchor;
 };
 
 int bcd2000_init_midi(struct bcd2000 *bcd2k);
 void bcd2000_free_midi(struct bcd2000 *bcd2k);
+void bcd2000_midi_resume_input(struct bcd2000 *bcd2k);
+void bcd2000_midi_resync(struct bcd2000 *bcd2k);
 
 #endif
\ No newline at end of file